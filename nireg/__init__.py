@@ -2,8 +2,9 @@ from __future__ import absolute_import
 # emacs: -*- mode: python; py-indent-offset: 4; indent-tabs-mode: nil -*-
 # vi: set ft=python sts=4 ts=4 sw=4 et:
 from .resample import resample
-from .histogram_registration import (HistogramRegistration, clamp,
-                                    ideal_spacing, interp_methods)
+from .histogram_registration import (HistogramRegistration, Template,
+                                    register_batch, clamp, ideal_spacing,
+                                    interp_methods)
 from .affine import (threshold, rotation_mat2vec, rotation_vec2mat, to_matrix44,
                      preconditioner, inverse_affine, subgrid_affine, Affine,
                      Affine2D, Rigid, Rigid2D, Similarity, Similarity2D,
@@ -2,8 +2,8 @@
 
 """
 Bindings for various image registration routines written in C: joint
-histogram computation, cubic spline interpolation, non-rigid
-transformations. 
+histogram computation, similarity measures, cubic spline
+interpolation, non-rigid transformations. 
 """
 
 __version__ = '0.3'
@@ -14,16 +14,67 @@ cdef extern from "_register.h":
 
 
 # Includes
-from numpy cimport (import_array, ndarray, flatiter, broadcast, 
+from numpy cimport (import_array, ndarray, broadcast, npy_intp, 
                     PyArray_MultiIterNew, PyArray_MultiIter_DATA, 
                     PyArray_MultiIter_NEXT)
+from libc.math cimport rint
 
 
 cdef extern from "joint_histogram.h":
+    enum: OCCUPANCY_CELL
+    enum: HISTOGRAM_DENSE
+    enum: HISTOGRAM_MOMENTS
+    enum: HISTOGRAM_HASHED
+    enum: HISTOGRAM_COUNTS
+    enum: HASHED_KEY_BASE
+    enum: SIMD_SCALAR
+    enum: SIMD_SSE2
+    enum: SIMD_AVX
+    enum: SIMD_AVX512
     int joint_histogram(ndarray H, unsigned int clampI, unsigned int clampJ,  
-                        flatiter iterI, ndarray imJ_padded, 
-                        ndarray Tvox, int interp)
+                        ndarray I, ndarray XYZ, ndarray imJ_padded, 
+                        ndarray layout, ndarray occupancy, ndarray Tvox,
+                        long interp,
+                        int mode,
+                        int sampling, npy_intp nsamples, long seed,
+                        npy_intp start, npy_intp stop) nogil
+    int joint_histogram_batch(ndarray H, unsigned int clampI,
+                              unsigned int clampJ, ndarray I, ndarray XYZ,
+                              ndarray imJ_padded, ndarray layout,
+                              ndarray occupancy, ndarray Tvox, long interp,
+                              int mode, int sampling, npy_intp nsamples,
+                              long seed,
+                              npy_intp start, npy_intp stop) nogil
+    int joint_histogram_gradient(ndarray H, ndarray G,
+                                 unsigned int clampI, unsigned int clampJ,
+                                 ndarray I, ndarray XYZ, ndarray imJ_padded,
+                                 ndarray layout, ndarray occupancy,
+                                 ndarray Tvox, long interp, int sampling,
+                                 npy_intp nsamples, long seed,
+                                 npy_intp start, npy_intp stop) nogil
+    int hashed_histogram_merge(ndarray H, ndarray P)
+    int joint_histogram_simd(int level)
     int L1_moments(double* n, double* median, double* dev, ndarray H)
+    int L1_moments_rows(double* n, double* median, double* dev, ndarray H)
+
+cdef extern from "similarity_measures.h":
+    int mutual_information(double* res, double* npts, ndarray H)
+    int normalized_mutual_information(double* res, double* npts, ndarray H)
+    int correlation_coefficient(double* res, double* npts, ndarray H)
+    int correlation_ratio(double* res, double* npts, ndarray H,
+                          int transpose)
+    int weighted_sum(double* res, double* npts, ndarray H, ndarray L)
+    int hashed_mutual_information(double* res, double* npts, ndarray T,
+                                  unsigned int clampI, unsigned int clampJ)
+    int hashed_normalized_mutual_information(double* res, double* npts,
+                                             ndarray T, unsigned int clampI,
+                                             unsigned int clampJ)
+    int hashed_correlation_ratio(double* res, double* npts, ndarray T,
+                                 unsigned int clampI, unsigned int clampJ,
+                                 int transpose)
+    int counts_mutual_information(double* res, double* npts, ndarray H)
+    int counts_normalized_mutual_information(double* res, double* npts,
+                                             ndarray H)
 
 cdef extern from "cubic_spline.h":
     void cubic_spline_transform(ndarray res, ndarray src)
@@ -46,32 +97,675 @@ cdef extern from "polyaffine.h":
 # Initialize numpy
 import_array()
 import numpy as np
+import threading
+from multiprocessing.pool import ThreadPool
 
 # Globals
 modes = {'zero': 0, 'nearest': 1, 'reflect': 2}
+_NO_OCCUPANCY = np.zeros((0, 0, 0), dtype=np.uint8)
+_thread_pools = {}
+_thread_pools_lock = threading.Lock()
+simd_levels = {'scalar': SIMD_SCALAR, 'sse2': SIMD_SSE2,
+               'avx': SIMD_AVX, 'avx512': SIMD_AVX512}
 
+# Select the default instruction set before any thread may do so
+joint_histogram_simd(-1)
 
-def _joint_histogram(ndarray H, flatiter iterI, ndarray imJ, ndarray Tvox, long interp):
+
+def _thread_pool(int nthreads):
+    """
+    Persistent pool of `nthreads` worker threads. Safe to call from
+    several threads, which then share the same pool.
+    """
+    with _thread_pools_lock:
+        if not nthreads in _thread_pools:
+            _thread_pools[nthreads] = ThreadPool(nthreads)
+        return _thread_pools[nthreads]
+
+
+def _simd(level=None):
+    """
+    Instruction set used by the joint histogram routines to transform
+    source samples in the affine case, as a key of `simd_levels`. By
+    default, this is the widest one supported by both the build and
+    the CPU. If `level` is a key of `simd_levels`, the widest
+    supported instruction set not wider than `level` is selected
+    first. Results only differ by rounding between instruction sets.
+    """
+    cdef int l = -1
+    if level is not None:
+        l = simd_levels[level]
+    l = joint_histogram_simd(l)
+    return [k for k in simd_levels if simd_levels[k] == l][0]
+
+
+def _split(npy_intp size, int nblocks):
+    """
+    Boundaries of `nblocks` contiguous blocks of approximately equal
+    sizes covering range(size).
+    """
+    return [(size * b) // nblocks for b in range(nblocks + 1)]
+
+
+def _workspace_array(workspace, key, shape, dtype='double'):
+    """
+    Array of given shape and type stored under `key` in the
+    `workspace` dictionary, which is only allocated if no such array
+    is found there. Its content is undefined. If `workspace` is None,
+    a new array is returned.
+    """
+    if workspace is None:
+        return np.empty(shape, dtype=dtype)
+    a = workspace.get(key)
+    if a is None or a.shape != tuple(shape) or a.dtype != dtype:
+        a = np.empty(shape, dtype=dtype)
+        workspace[key] = a
+    return a
+
+
+def _map_blocks(func, outs, npy_intp size, int nthreads, merge=None,
+                shared=False, workspace=None):
+    """
+    Split range(size) into `nthreads` contiguous blocks and call
+    ``func(b, outs_b, start, stop)`` for each block `b` in a separate
+    thread, where `outs_b` is `outs` for the first block and a list
+    of private arrays shaped like `outs` otherwise. Private arrays
+    are then summed into `outs` in block order, or added using
+    ``merge(out, private)`` if given, so that the result is
+    deterministic for a given number of threads. If `shared` is
+    True, `func` is assumed to update `outs` atomically, and all
+    blocks are passed `outs` itself.
+
+    Private arrays are kept in the `workspace` dictionary, if given,
+    and reused by later calls with outputs of the same shapes. `func`
+    should then overwrite rather than update them.
+    """
+    if nthreads < 2:
+        func(0, outs, 0, size)
+        return
+    bounds = _split(size, nthreads)
+    if shared:
+        _thread_pool(nthreads).map(
+            lambda b: func(b, outs, bounds[b], bounds[b + 1]),
+            range(nthreads))
+        return
+    if workspace is None:
+        priv = [outs] + [[np.zeros_like(o) for o in outs]
+                         for b in range(1, nthreads)]
+    else:
+        priv = [outs] + [[_workspace_array(workspace,
+                                           ('block', b, i, o.shape),
+                                           o.shape, o.dtype)
+                          for i, o in enumerate(outs)]
+                         for b in range(1, nthreads)]
+    _thread_pool(nthreads).map(
+        lambda b: func(b, priv[b], bounds[b], bounds[b + 1]),
+        range(nthreads))
+    for b in range(1, nthreads):
+        for o, p in zip(outs, priv[b]):
+            if merge is None:
+                o += p
+            else:
+                merge(o, p)
+
+
+def _mask_value(dtype):
+    """
+    Value of masked voxels in clamped images of given integer type: -1
+    for signed types, and the largest value for unsigned types.
+    """
+    dtype = np.dtype(dtype)
+    if dtype.kind == 'u':
+        return np.iinfo(dtype).max
+    return -1
+
+
+def _unmasked(ndarray data):
+    """
+    Boolean array of the valid voxels of a clamped image.
+    """
+    if data.dtype.kind == 'u':
+        return data != _mask_value(data.dtype)
+    return data >= 0
+
+
+def _samples(ndarray data, int tile=0):
+    """
+    Packed list of the valid voxels of a source image, see
+    `_unmasked`.
+
+    If `tile` is positive and the image is three-dimensional, voxels
+    are listed tile by tile, where tiles are cubes of side `tile`
+    visited in C order, and voxels within each tile are in C
+    order. Consecutive samples are then close to each other in any
+    direction, and so are their transforms, which improves memory
+    locality of target image accesses under rotations.
+
+    Returns
+    -------
+    I : ndarray
+      Contiguous array of the N valid intensities, in C order or tile
+      order, either unsigned char if `data` is, or signed short
+    XYZ : ndarray
+      C-contiguous int array of shape (data.ndim, N) holding the
+      corresponding grid coordinates
+    """
+    msk = _unmasked(data)
+    I = data[msk]
+    XYZ = np.nonzero(msk)
+    if tile > 0 and data.ndim == 3:
+        shape = -(-np.array(np.shape(data)) // tile) * tile
+        layout = _layout(shape, tile)
+        order = np.argsort(layout[0][XYZ[0]] + layout[1][XYZ[1]] +
+                           layout[2][XYZ[2]])
+        I = I[order]
+        XYZ = [c[order] for c in XYZ]
+    dtype = 'uint8' if data.dtype == np.uint8 else 'short'
+    return (np.ascontiguousarray(I, dtype=dtype),
+            np.ascontiguousarray(XYZ, dtype='intc'))
+
+
+def _as_samples(src, Tvox):
+    """
+    Convert a flat iterator over a source image into packed samples
+    (see `_samples`), restricting pre-computed transformed
+    coordinates accordingly. Tuples of packed samples are passed
+    through.
+    """
+    if isinstance(src, tuple):
+        return src[0], src[1], Tvox
+    data = src.base
+    I, XYZ = _samples(data)
+    if not Tvox.shape[-1] == 4:
+        Tvox = np.ascontiguousarray(Tvox.reshape((-1, 3))[_unmasked(data).ravel()])
+    return I, XYZ, Tvox
+
+
+def _layout(shape, int brick=0):
+    """
+    Offsets of the grid points along each axis in a three-dimensional
+    array of given shape, stored either in C order if `brick` is zero,
+    or as returned by `_bricked` otherwise, in which case `shape`
+    should be a multiple of `brick`.
+
+    Returns
+    -------
+    layout : ndarray
+      C-contiguous intp array of shape (3, max(shape)) such that
+      point (x, y, z) is stored at offset ``layout[0, x] + layout[1,
+      y] + layout[2, z]``
+    """
+    shape = np.asarray(shape)
+    k = np.arange(shape.max(), dtype=np.intp)
+    if brick == 0:
+        outer = [shape[1] * shape[2], shape[2], 1]
+        return np.ascontiguousarray([k * o for o in outer], dtype=np.intp)
+    nb = shape // brick
+    size = brick ** 3
+    outer = [nb[1] * nb[2] * size, nb[2] * size, size]
+    inner = [brick ** 2, brick, 1]
+    return np.ascontiguousarray([(k // brick) * o + (k % brick) * i
+                                 for o, i in zip(outer, inner)],
+                                dtype=np.intp)
+
+
+def _bricked(ndarray data, int brick, fill=None):
+    """
+    Copy of a three-dimensional array stored as a C-ordered sequence
+    of cubic bricks of side `brick`, each of which is stored in C
+    order. The array is first padded with `fill` up to a multiple of
+    `brick` along each axis, which defaults to the masked value of the
+    array type (see `_mask_value`). The result has the padded shape, and
+    should be accessed through ``_layout(shape, brick)``.
+    """
+    shape = -(-np.array(np.shape(data)) // brick) * brick
+    nb = shape // brick
+    out = np.empty(shape, dtype=data.dtype)
+    if fill is None:
+        fill = _mask_value(data.dtype)
+    out.fill(fill)
+    out[tuple(slice(0, d) for d in np.shape(data))] = data
+    out = out.reshape((nb[0], brick, nb[1], brick, nb[2], brick))
+    return np.ascontiguousarray(out.transpose((0, 2, 4, 1, 3, 5))).reshape(shape)
+
+
+def _occupancy(ndarray data, shape=None):
+    """
+    Occupancy map of a padded target image in C order, as used by the
+    joint histogram routines to reject samples falling in masked
+    regions.
+
+    The map has one entry per cell of ``OCCUPANCY_CELL ** 3`` grid
+    points, which is zero if no grid point ``n`` in the cell has an
+    unmasked voxel among ``n + {0, 1} ** 3``. If `shape` is given, e.g.
+    the shape of the bricked image (see `_bricked`), the image is
+    considered padded with masked voxels up to that shape.
+    """
+    cdef int cell = OCCUPANCY_CELL
+    if shape is None:
+        shape = np.shape(data)
+    nc = -(-np.array(shape) // cell)
+    valid = np.zeros(nc * cell + 1, dtype=bool)
+    valid[tuple(slice(0, d) for d in np.shape(data))] = _unmasked(data)
+    # Whether any of the voxels n + {0, 1} ** 3 is unmasked
+    for axis in range(3):
+        v = np.moveaxis(valid, axis, 0)
+        v[:-1] |= v[1:]
+    valid = valid[:-1, :-1, :-1].reshape((nc[0], cell, nc[1], cell,
+                                          nc[2], cell))
+    return np.ascontiguousarray(valid.any(axis=(1, 3, 5)), dtype=np.uint8)
+
+
+def _hashed_histogram(npy_intp capacity):
+    """
+    Empty hashed histogram with room for at least `capacity` entries,
+    i.e. of capacity the smallest power of two above ``2 *
+    capacity``, see ``joint_histogram.h``.
+    """
+    cdef npy_intp C = 2
+    while C < 2 * capacity:
+        C *= 2
+    return np.zeros((C + 1, 2))
+
+
+def _hashed_merge(ndarray H, ndarray P):
+    """
+    Add the entries of the hashed histogram `P` to `H`.
+    """
+    if not hashed_histogram_merge(H, P) == 0:
+        raise RuntimeError('Hashed histogram merge failed because of incorrect input arrays.')
+
+
+def _hashed_dense(ndarray T, bins):
+    """
+    Dense joint histogram of shape `bins` from a hashed histogram.
+    """
+    keys = T[:-1, 0]
+    occupied = keys > 0
+    i, j = np.divmod(keys[occupied].astype(np.intp) - 1, HASHED_KEY_BASE)
+    H = np.zeros(bins)
+    np.add.at(H, (i, j), T[:-1, 1][occupied])
+    return H
+
+
+def _ndraws(ndarray I, int sampling, npy_intp nsamples):
+    """
+    Number of source sample draws for a given sampling scheme.
+    """
+    if sampling == 0 or I.size == 0:
+        return I.size if sampling == 0 else 0
+    return max(nsamples, 0)
+
+
+def _joint_histogram(ndarray H, src, ndarray imJ, ndarray Tvox,
+                     long interp, int nthreads=1, int sampling=0,
+                     npy_intp nsamples=0, long seed=0, int moments=0,
+                     ndarray layout=None, ndarray occupancy=None,
+                     int hashed=0, workspace=None):
     """
     Compute the joint histogram given a transformation trial. 
+
+    `src` is either a tuple ``(I, XYZ)`` of packed source samples as
+    returned by `_samples`, or a flat iterator over the source image,
+    which is then packed on the fly.
+
+    `Tvox` is either a (3, 4) or (4, 4) voxel-to-voxel affine matrix,
+    which is then applied on the fly to the grid coordinates of the
+    source samples, or an array of pre-computed transformed
+    coordinates with last dimension of size 3 (one triplet per
+    sample, or per voxel if `src` is a flat iterator). Either is
+    double, or fixed-point int as returned by `_fixed_point`.
+
+    `interp` is 0 for partial volume, 1 for trilinear, 2 for Parzen
+    window interpolation, which spreads each sample over the 4
+    nearest target bins with a cubic B-spline kernel, and negative
+    for random interpolation. Other positive values are rejected.
+    Parzen windows are not supported in hashed mode.
+
+    If `nthreads` is greater than one, the source samples are split
+    into `nthreads` contiguous blocks, each of which is processed by
+    a separate thread into a private histogram. The private
+    histograms are then summed up in block order, so that the result
+    is deterministic for a given number of threads. In random
+    interpolation mode, the seed is ``-interp``.
+
+    `sampling` selects the source samples accounted for: 0 for all
+    of them, 1 for `nsamples` samples drawn at random with
+    replacement, 2 for a stratified subset of `nsamples` samples, one
+    per stratum of consecutive samples. The subsets are drawn within
+    the C routine using `seed`.
+
+    Random numbers are drawn from a counter-based generator indexed
+    by the sample draw, hence stochastic results are the same
+    whatever the number of threads, up to rounding errors.
+
+    If `moments` is non-zero, `H` should have shape ``(clampI, 3)``
+    and is filled with the moments of order 0, 1 and 2 of the target
+    intensity given each source intensity instead of the joint
+    histogram.
+
+    `layout` gives the storage order of `imJ` as returned by
+    `_layout`, e.g. for a target image bricked with `_bricked`. It
+    defaults to C order.
+
+    `occupancy` is an optional occupancy map of `imJ` as returned by
+    `_occupancy`, which speeds up computation for targets with large
+    masked regions without changing the result.
+
+    If `hashed` is non-zero, `H` should be a hashed histogram as
+    returned by `_hashed_histogram`, which is filled with the
+    non-empty joint histogram entries. Memory and initialization time
+    then scale with the number of such entries rather than with the
+    number of bins. If `H` gets too small, the computation is resumed
+    with tables of twice the capacity.
+
+    If `H` is a uint32 array, random interpolation draws are counted
+    as integers, which requires negative `interp`. Threads then
+    increment the counts of `H` atomically rather than filling
+    private histograms, which saves memory and the final summation
+    for large numbers of bins. The result does not depend on the
+    number of threads.
+
+    `workspace` is an optional dictionary in which the private
+    histograms of threads are kept for reuse by later calls, see
+    `_map_blocks`, so that repeated calls do not allocate them anew.
+
+    Returns
+    -------
+    H : ndarray
+      The histogram, which in hashed mode may be a new, larger table
     """
     cdef:
-        double *h
-        double *tvox
-        unsigned int clampI
-        unsigned int clampJ
+        unsigned int clampI = <unsigned int>H.shape[0]
+        unsigned int clampJ = <unsigned int>H.shape[1]
+        int mode = HISTOGRAM_DENSE
+        ndarray I, XYZ
+
+    if moments:
+        mode = HISTOGRAM_MOMENTS
+    elif hashed:
+        mode = HISTOGRAM_HASHED
+    elif H.dtype == np.uint32:
+        mode = HISTOGRAM_COUNTS
+    I, XYZ, Tvox = _as_samples(src, Tvox)
+    if layout is None:
+        layout = _layout(np.shape(imJ))
+    if occupancy is None:
+        occupancy = _NO_OCCUPANCY
+
+    def block(int b, outs, npy_intp start, npy_intp stop):
+        cdef:
+            ndarray Hb = outs[0]
+            int ret
+        with nogil:
+            ret = joint_histogram(Hb, clampI, clampJ, I, XYZ, imJ, layout,
+                                  occupancy, Tvox, interp, mode, sampling,
+                                  nsamples, seed, start, stop)
+        if not ret == 0:
+            raise RuntimeError('Joint histogram failed because of incorrect input arrays.')
+
+    if mode == HISTOGRAM_COUNTS:
+        H.fill(0)
+        _map_blocks(block, [H], _ndraws(I, sampling, nsamples), nthreads,
+                    shared=True)
+        return H
+    if mode != HISTOGRAM_HASHED:
+        _map_blocks(block, [H], _ndraws(I, sampling, nsamples), nthreads,
+                    workspace=workspace)
+        return H
+    # Contributions are dropped once tables are half full
+    while True:
+        _map_blocks(block, [H], _ndraws(I, sampling, nsamples), nthreads,
+                    merge=_hashed_merge, workspace=workspace)
+        if H[-1, 1] == 0:
+            return H
+        H = _hashed_histogram(H.shape[0] - 1)
+
+
+def _joint_histogram_batch(ndarray H, src, ndarray imJ,
+                           ndarray Tvox, long interp, int nthreads=1,
+                           int sampling=0, npy_intp nsamples=0, long seed=0,
+                           int moments=0, ndarray layout=None,
+                           ndarray occupancy=None, workspace=None):
+    """
+    Compute the joint histograms ``H[k]`` corresponding to a batch of
+    affine voxel-to-voxel transformations ``Tvox[k]`` in a single pass
+    over the source image.
+
+    `H` should be double C-contiguous with shape ``(K, clampI,
+    clampJ)``, or ``(K, clampI, 3)`` if `moments` is non-zero, and
+    `Tvox` with shape ``(K, 3, 4)`` or ``(K, 4, 4)``. See `_joint_histogram` regarding other arguments. The same
+    source samples are used for all transformations.
+    """
+    cdef:
+        unsigned int clampI = <unsigned int>H.shape[1]
+        unsigned int clampJ = <unsigned int>H.shape[2]
+        ndarray I, XYZ
+
+    I, XYZ, Tvox = _as_samples(src, Tvox)
+    if layout is None:
+        layout = _layout(np.shape(imJ))
+    if occupancy is None:
+        occupancy = _NO_OCCUPANCY
+
+    def block(int b, outs, npy_intp start, npy_intp stop):
+        cdef:
+            ndarray Hb = outs[0]
+            int ret
+        with nogil:
+            ret = joint_histogram_batch(Hb, clampI, clampJ, I, XYZ, imJ,
+                                        layout, occupancy, Tvox, interp,
+                                        moments, sampling, nsamples, seed,
+                                        start, stop)
+        if not ret == 0:
+            raise RuntimeError('Joint histogram failed because of incorrect input arrays.')
+
+    _map_blocks(block, [H], _ndraws(I, sampling, nsamples), nthreads,
+                workspace=workspace)
+
+
+def _fixed_point(T, ndarray out=None):
+    """
+    16.16 fixed-point encoding of affine voxel-to-voxel
+    transformations or of transformed coordinates, which the joint
+    histogram routines accept in place of doubles. Values beyond the
+    int range, which are far outside any target grid, are clipped.
+
+    The result is written into `out` if given, which should be an
+    int C-contiguous array of the same size as `T`, so that no
+    temporary array is allocated when `T` is double C-contiguous.
+    """
+    cdef:
+        ndarray Td = np.ascontiguousarray(T, dtype=np.double)
+        double* t
+        int* o
+        double v, vmin = np.iinfo(np.intc).min, vmax = np.iinfo(np.intc).max
+        npy_intp k, n = Td.size
+
+    if out is None:
+        out = np.empty(np.shape(Td), dtype=np.intc)
+    elif out.dtype != np.intc or out.size != n or \
+            not out.flags['C_CONTIGUOUS']:
+        raise ValueError('out should be an int C-contiguous array of the input size')
+    t = <double*>Td.data
+    o = <int*>out.data
+    with nogil:
+        for k in range(n):
+            # Rounding half to even as np.round
+            v = rint(t[k] * 65536)
+            if v < vmin:
+                v = vmin
+            elif v > vmax:
+                v = vmax
+            o[k] = <int>v
+    return out
+
+
+def _joint_histogram_gradient(ndarray H, ndarray G, src,
+                              ndarray imJ, ndarray Tvox, int nthreads=1,
+                              int sampling=0, npy_intp nsamples=0,
+                              long seed=0, ndarray layout=None,
+                              ndarray occupancy=None, long interp=0,
+                              workspace=None):
+    """
+    Compute the partial volume joint histogram `H` and its gradient
+    `G` with respect to the coefficients of the affine voxel-to-voxel
+    transformation `Tvox`, given as a (3, 4) or (4, 4) array. If
+    `interp` is 2, Parzen window interpolation is used instead of
+    partial volume, see `_joint_histogram`.
+
+    `G` should be double C-contiguous with shape ``H.shape + (12,)``,
+    such that ``G[i, j, 4 * a + b]`` is the derivative of ``H[i, j]``
+    with respect to ``Tvox[a, b]``. See `_joint_histogram` regarding
+    other arguments.
+    """
+    cdef:
+        unsigned int clampI = <unsigned int>H.shape[0]
+        unsigned int clampJ = <unsigned int>H.shape[1]
+        ndarray I, XYZ
+
+    I, XYZ, Tvox = _as_samples(src, Tvox)
+    if layout is None:
+        layout = _layout(np.shape(imJ))
+    if occupancy is None:
+        occupancy = _NO_OCCUPANCY
+
+    def block(int b, outs, npy_intp start, npy_intp stop):
+        cdef:
+            ndarray Hb = outs[0]
+            ndarray Gb = outs[1]
+            int ret
+        with nogil:
+            ret = joint_histogram_gradient(Hb, Gb, clampI, clampJ, I, XYZ,
+                                           imJ, layout, occupancy, Tvox,
+                                           interp, sampling, nsamples, seed,
+                                           start, stop)
+        if not ret == 0:
+            raise RuntimeError('Joint histogram gradient failed because of incorrect input arrays.')
+
+    _map_blocks(block, [H, G], _ndraws(I, sampling, nsamples), nthreads,
+                workspace=workspace)
+
+
+def _similarity(ndarray H, measure, ndarray L=None):
+    """
+    Compute a similarity statistic from a joint histogram in C.
+
+    Parameters
+    ----------
+    H : ndarray
+      Double C-contiguous joint histogram
+    measure : str
+      One of 'mi' (mutual information times the histogram mass),
+      'nmi' (normalized mutual information), 'cc' (squared
+      correlation coefficient), 'cr' (correlation ratio of the column
+      index given the row index), 'rcr' (correlation ratio of the row
+      index given the column index) or 'sum' (sum of ``H * L``)
+    L : ndarray
+      Double C-contiguous array of the same shape as `H`, only used
+      for the 'sum' measure
+
+    Returns
+    -------
+    s : float
+      Statistic value
+    npts : float
+      Histogram mass
+    """
+    cdef:
+        double res, npts
         int ret
+    if measure == 'mi':
+        ret = mutual_information(&res, &npts, H)
+    elif measure == 'nmi':
+        ret = normalized_mutual_information(&res, &npts, H)
+    elif measure == 'cc':
+        ret = correlation_coefficient(&res, &npts, H)
+    elif measure == 'cr':
+        ret = correlation_ratio(&res, &npts, H, 0)
+    elif measure == 'rcr':
+        ret = correlation_ratio(&res, &npts, H, 1)
+    elif measure == 'sum':
+        ret = weighted_sum(&res, &npts, H, L)
+    else:
+        raise ValueError('unknown measure: %s' % measure)
+    if not ret == 0:
+        raise RuntimeError('Similarity computation failed because of incorrect input arrays.')
+    return res, npts
 
-    # Views
-    clampI = <unsigned int>H.shape[0]
-    clampJ = <unsigned int>H.shape[1]    
 
-    # Compute joint histogram 
-    ret = joint_histogram(H, clampI, clampJ, iterI, imJ, Tvox, interp)
+def _hashed_similarity(ndarray T, measure, bins):
+    """
+    Compute a similarity statistic from a hashed histogram in C, see
+    `_hashed_histogram` and `_similarity`.
+
+    Parameters
+    ----------
+    T : ndarray
+      Hashed histogram
+    measure : str
+      One of 'mi', 'nmi', 'cr' or 'rcr'
+    bins : tuple
+      Shape of the joint histogram
+
+    Returns
+    -------
+    s : float
+      Statistic value
+    npts : float
+      Histogram mass
+    """
+    cdef:
+        double res, npts
+        unsigned int clampI = bins[0], clampJ = bins[1]
+        int ret
+    if measure == 'mi':
+        ret = hashed_mutual_information(&res, &npts, T, clampI, clampJ)
+    elif measure == 'nmi':
+        ret = hashed_normalized_mutual_information(&res, &npts, T, clampI,
+                                                   clampJ)
+    elif measure == 'cr':
+        ret = hashed_correlation_ratio(&res, &npts, T, clampI, clampJ, 0)
+    elif measure == 'rcr':
+        ret = hashed_correlation_ratio(&res, &npts, T, clampI, clampJ, 1)
+    else:
+        raise ValueError('unknown measure: %s' % measure)
     if not ret == 0:
-        raise RuntimeError('Joint histogram failed because of incorrect input arrays.')
+        raise RuntimeError('Similarity computation failed because of incorrect input arrays.')
+    return res, npts
 
-    return 
+
+def _counts_similarity(ndarray H, measure):
+    """
+    Compute a similarity statistic from a uint32 C-contiguous count
+    histogram in C, see `_joint_histogram` and `_similarity`.
+
+    Parameters
+    ----------
+    H : ndarray
+      Count histogram
+    measure : str
+      One of 'mi' or 'nmi'
+
+    Returns
+    -------
+    s : float
+      Statistic value
+    npts : float
+      Histogram mass
+    """
+    cdef:
+        double res, npts
+        int ret
+    if measure == 'mi':
+        ret = counts_mutual_information(&res, &npts, H)
+    elif measure == 'nmi':
+        ret = counts_normalized_mutual_information(&res, &npts, H)
+    else:
+        raise ValueError('unknown measure: %s' % measure)
+    if not ret == 0:
+        raise RuntimeError('Similarity computation failed because of incorrect input arrays.')
+    return res, npts
 
 
 def _L1_moments(ndarray H):
@@ -92,6 +786,31 @@ def _L1_moments(ndarray H):
     return n[0], median[0], dev[0]
 
 
+def _L1_moments_rows(ndarray H):
+    """
+    Compute L1 moments of order 0, 1 and 2 of each row of a
+    two-dimensional histogram.
+
+    Returns
+    -------
+    n, median, dev : ndarray
+      One-dimensional arrays of size ``H.shape[0]``
+    """
+    cdef:
+        ndarray n, median, dev
+        int ret
+
+    n = np.zeros(H.shape[0])
+    median = np.zeros(H.shape[0])
+    dev = np.zeros(H.shape[0])
+    ret = L1_moments_rows(<double*>n.data, <double*>median.data,
+                          <double*>dev.data, H)
+    if not ret == 0:
+        raise RuntimeError('L1_moments_rows failed because input array is not double or two-dimensional.')
+
+    return n, median, dev
+
+
 def _cspline_transform(ndarray x):
     c = np.zeros([x.shape[i] for i in range(x.ndim)], dtype=np.double)
     cubic_spline_transform(c, x)
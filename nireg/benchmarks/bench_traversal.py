@@ -0,0 +1,69 @@
+#!/usr/bin/env python
+# emacs: -*- mode: python; py-indent-offset: 4; indent-tabs-mode: nil -*-
+# vi: set ft=python sts=4 ts=4 sw=4 et:
+"""
+Benchmark of the source voxel traversal order in joint histogram
+computation: C order versus tile order (see
+`HistogramRegistration.set_fov`) for rotations of increasing angle
+about the first axis.
+
+Run as a script::
+
+  python -m nireg.benchmarks.bench_traversal
+"""
+from __future__ import absolute_import
+from __future__ import print_function
+
+from timeit import default_timer as time
+
+import numpy as np
+
+from ..affine import rotation_vec2mat
+from .._register import _joint_histogram, _samples
+
+
+def _make_data(shape, bins):
+    return np.random.randint(size=shape, low=0, high=bins).astype('short')
+
+
+def _timing(H, src, data, Tv, interp, repeat):
+    best = np.inf
+    for _ in range(repeat):
+        H.fill(0)
+        t0 = time()
+        _joint_histogram(H, src, data, Tv, interp)
+        best = min(best, time() - t0)
+    return best
+
+
+def bench_traversal(shape=(160, 160, 160), tile=8,
+                    angles=(0, 15, 30, 45, 90), interp=0, repeat=5):
+    """
+    Print joint histogram computation times in C order and tile
+    order, and the resulting speedup, for each rotation angle in
+    degrees.
+    """
+    bins = 64
+    from_data = _make_data(shape, bins)
+    to_data = _make_data(np.array(shape) + 2, bins)
+    center = (np.array(shape) - 1) / 2.
+    src = _samples(from_data)
+    tsrc = _samples(from_data, tile)
+    H = np.zeros((bins, bins))
+    H1 = np.zeros((bins, bins))
+    print('Shape %s, tile %d, interp %d' % (shape, tile, interp))
+    print('%8s %12s %12s %8s' % ('angle', 'C order', 'tile order',
+                                 'speedup'))
+    for angle in angles:
+        # Rotation about the image center, shifted by one voxel to
+        # account for the padding of the target image
+        A = rotation_vec2mat(np.array([np.radians(angle), 0, 0]))
+        Tv = np.hstack((A, (center + 1 - np.dot(A, center))[:, None]))
+        t = _timing(H, src, to_data, Tv, interp, repeat)
+        t1 = _timing(H1, tsrc, to_data, Tv, interp, repeat)
+        assert np.allclose(H1, H)
+        print('%8g %12.4f %12.4f %8.2f' % (angle, t, t1, t / t1))
+
+
+if __name__ == '__main__':
+    bench_traversal()
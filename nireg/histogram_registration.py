@@ -7,26 +7,53 @@ from __future__ import absolute_import
 from __future__ import print_function
 
 import os
+import copy
+import hashlib
+import time
+import threading
+from multiprocessing.pool import ThreadPool
 import numpy as np
 import scipy.ndimage as nd
 from nibabel import Nifti1Image
 
-from .optimizer import configure_optimizer
+from .optimizer import configure_optimizer, use_derivatives
 from .affine import inverse_affine, subgrid_affine, affine_transforms
 from .chain_transform import ChainTransform
 from .similarity_measures import similarity_measures as builtin_simi
-from ._register import _joint_histogram
+from ._register import (_joint_histogram, _joint_histogram_batch,
+                        _joint_histogram_gradient, _samples, _layout,
+                        _bricked, _occupancy, _mask_value, _unmasked,
+                        _fixed_point, _hashed_histogram, _workspace_array,
+                        _split, _thread_pool, _NO_OCCUPANCY)
 
-MAX_INT = np.iinfo(np.intp).max
 
 # Module globals
 VERBOSE = os.environ.get('NIREG_DEBUG_PRINT', False)  # enables online print statements
-CLAMP_DTYPE = 'short'  # do not edit
+# Clamped image types, narrowest first. Masked voxels are encoded as
+# -1 in signed types, and as the largest value in unsigned types.
+CLAMP_DTYPES = ('uint8', 'short')  # do not edit
 NPOINTS = 64 ** 3
+# Maximum number and total size in bytes of joint histograms computed
+# in a single pass. Large batches of large histograms do not fit in
+# cache and end up slower than sequential computation.
+BATCH_SIZE = 16
+BATCH_BYTES = 2 ** 21
+# Initial number of entries of hashed joint histograms, which grow
+# as needed
+HASHED_ENTRIES = 2 ** 12
+# Version of the preprocessed images stored by `cached_arrays`, to be
+# incremented whenever clamping or padding changes
+CACHE_VERSION = 1
+# Atomic file renaming, also overwriting existing files on Windows
+_replace = getattr(os, 'replace', os.rename)
 
 # Dictionary of interpolation methods (partial volume, trilinear,
-# random)
-interp_methods = {'pv': 0, 'tri': 1, 'rand': -1}
+# random, Parzen window)
+interp_methods = {'pv': 0, 'tri': 1, 'rand': -1, 'parzen': 2}
+
+# Dictionary of stochastic source sampling methods
+sampling_methods = {'random': 1, 'stratified': 2}
+MAX_SEED = 2 ** 31 - 1
 
 
 def unpack(val, numtype):
@@ -38,6 +65,73 @@ def unpack(val, numtype):
     return out
 
 
+class Template(object):
+    """
+    Preprocessed `to` image of histogram registrations: clamped data
+    padded with masked voxels, storage layout, occupancy map and
+    inverse affine. A template is never modified once built, hence it
+    can be shared by any number of `HistogramRegistration` objects,
+    including ones used concurrently in several threads, see
+    `register_batch`.
+    """
+    def __init__(self, img, bins=256, mask=None, sigma=0, brick=None,
+                 cache=None):
+        """
+        Parameters
+        ----------
+        img : nibabel image
+          `To` image
+        bins : int
+          Number of histogram bins, which may be reduced if
+          unnecessarily large
+        mask : array-like
+          Mask to apply to the image
+        sigma : float
+          Standard deviation in millimeters of the Gaussian kernel
+          used to smooth the image
+        brick : None or int
+          Side of the cubic bricks the image is stored by, see
+          `HistogramRegistration`
+        cache : None or str
+          Directory of preprocessed images, see `HistogramRegistration`
+        """
+        self.img = img
+        self.mask = mask
+        self.nominal_bins = int(bins)
+        self.sigma = float(sigma)
+        self.brick = brick
+
+        def clamp_to():
+            data, bins = clamp(img, self.nominal_bins, mask=mask,
+                               sigma=self.sigma)
+            to_data = np.empty(np.array(img.shape) + 2, dtype=data.dtype)
+            to_data.fill(_mask_value(data.dtype))
+            to_data[1:-1, 1:-1, 1:-1] = data
+            occupancy = _NO_OCCUPANCY
+            if brick is not None:
+                data = _bricked(to_data, int(brick))
+            else:
+                data = to_data
+            # Occupancy map to skip samples falling in masked regions,
+            # only worth it when a mask is given
+            if mask is not None:
+                occupancy = _occupancy(to_data, data.shape)
+            return data, np.array(bins), occupancy
+
+        key = image_key(img, mask, 'to', self.nominal_bins, self.sigma,
+                        brick)
+        self.data, bins, occupancy = cached_arrays(cache, key, clamp_to)
+        self.bins = int(bins)
+        if brick is None:
+            self.layout = _layout(self.data.shape)
+        else:
+            self.layout = _layout(self.data.shape, int(brick))
+        self.occupancy = None
+        if mask is not None:
+            self.occupancy = occupancy
+        self.inv_affine = inverse_affine(img.get_affine())
+
+
 class HistogramRegistration(object):
     """
     A class to reprensent a generic intensity-based image registration
@@ -52,7 +146,15 @@ class HistogramRegistration(object):
                  interp='pv',
                  sigma=0,
                  renormalize=False,
-                 dist=None):
+                 dist=None,
+                 nthreads=1,
+                 sampling=None,
+                 nsamples=None,
+                 brick=None,
+                 tile=None,
+                 fixed_point=False,
+                 hashed=False,
+                 cache=None):
         """Creates a new histogram registration object.
 
         Parameters
@@ -88,13 +190,80 @@ class HistogramRegistration(object):
           'slr' measure. Should be of shape (from_bins, to_bins).
        interp : str
          Interpolation method.  One of 'pv': Partial volume, 'tri':
-         Trilinear, 'rand': Random interpolation.  See ``joint_histogram.c``
+         Trilinear, 'rand': Random interpolation, 'parzen': Parzen
+         window interpolation, where each voxel is spread over
+         neighboring `to` bins with a cubic B-spline kernel. With
+         'mi', the latter is Mattes mutual information, a smooth
+         alternative to 'pmi' and 'dpmi' suitable for gradient-based
+         optimizers. With 'rand', 'mi' and 'nmi' are computed from
+         an integer joint histogram shared by all threads. See
+         ``joint_histogram.c``
        sigma : float or sequence
          Standard deviation(s) in millimeters of isotropic Gaussian
          kernels used to smooth the `from` and `to` images,
          respectively. If float, the same kernel size is applied to
          both images. If 0, no smoothing is applied.
+       nthreads : int
+         Number of threads used to compute the joint histogram. The
+         result is deterministic for a given number of threads.
+       sampling : None or str
+         If None, all voxels in the field of view defined by `spacing`
+         are used to compute the joint histogram. Otherwise, a fresh
+         subset of `nsamples` voxels is drawn from the field of view
+         at each evaluation, or at each iteration in `optimize`,
+         either with 'random' or 'stratified' sampling. See
+         ``joint_histogram.c``.
+       nsamples : None or int
+         Number of voxels drawn in stochastic sampling mode. If None,
+         the field of view size is used, up to `NPOINTS`.
+       brick : None or int
+         If not None, the `to` image is stored as a sequence of cubic
+         bricks of side `brick`, e.g. 8, rather than in C order. This
+         keeps the neighbors of transformed voxels within fewer cache
+         lines and memory pages, which speeds up joint histogram
+         computation for large `to` images.
+       tile : None or int
+         Traversal order of the `from` image voxels, see `set_fov`.
+       fixed_point : boolean
+         If True, transformed voxel coordinates are computed in 16.16
+         fixed-point arithmetic rather than in double precision, which
+         is faster but perturbs interpolation weights by less than
+         about 0.01 for images of size up to 512. Only applies to
+         similarity evaluations, not to gradients computed from the
+         joint histogram.
+       hashed : boolean
+         If True, similarity evaluations accumulate the non-empty
+         joint histogram entries in a hash table rather than in a
+         dense (from_bins, to_bins) array, for the measures that
+         support it ('mi', 'nmi', 'rcr'). Memory and computation time
+         then scale with the number of non-empty entries, which pays
+         off for large numbers of bins, e.g. 4096, where most entries
+         are empty. Not used with 'parzen' interpolation.
+       cache : None or str
+         Directory where the clamped `from` image and the clamped,
+         padded `to` image are stored as .npy files, keyed by a hash
+         of the image data, affine and mask and of the `bins`,
+         `sigma` and `brick` arguments. Later constructions with the
+         same inputs, e.g. in other processes, memory-map these
+         files read-only instead of smoothing and clamping the images
+         again, which pays off when registering many images to the
+         same template. See `cached_arrays`.
+
+        The `to` image may also be given as a `Template`, whose
+        preprocessed data are then shared with other registrations
+        rather than recomputed, in which case the `to_mask` and
+        `brick` arguments and the `to` parts of `bins` and `sigma`
+        are ignored.
         """
+        # Construction arguments, kept to set up the levels of
+        # multi-resolution optimizations, see `optimize`
+        self._level_args = dict(from_img=from_img, to_img=to_img,
+                                from_mask=from_mask, to_mask=to_mask,
+                                bins=bins, similarity=similarity,
+                                renormalize=renormalize, dist=dist,
+                                brick=brick, tile=tile, cache=cache)
+        self._levels = {}
+
         # Binning sizes
         from_bins, to_bins = unpack(bins, int)
 
@@ -103,17 +272,23 @@ class HistogramRegistration(object):
 
         # Clamping of the `from` image. The number of bins may be
         # overriden if unnecessarily large.
-        data, from_bins_adjusted = clamp(from_img,
-                                         from_bins,
-                                         mask=from_mask,
-                                         sigma=self._from_sigma)
+        def clamp_from():
+            data, bins = clamp(from_img, from_bins, mask=from_mask,
+                               sigma=self._from_sigma)
+            return data, np.array(bins)
+
+        key = image_key(from_img, from_mask, 'from', from_bins,
+                        self._from_sigma)
+        data, from_bins_adjusted = cached_arrays(cache, key, clamp_from)
+        from_bins_adjusted = int(from_bins_adjusted)
         if not similarity == 'slr':
             from_bins = from_bins_adjusted
         self._from_img = Nifti1Image(data, from_img.get_affine())
 
         # Set field of view in the `from` image with potential
         # subsampling for faster similarity evaluation. This also sets
-        # the _from_data and _vox_coords attributes
+        # the _from_data, _from_values, _from_coords and _vox_coords
+        # attributes
         if spacing == None:
             npoints = NPOINTS
         else:
@@ -123,27 +298,61 @@ class HistogramRegistration(object):
         else:
             corner, size = smallest_bounding_box(from_mask)
         self.set_fov(spacing=spacing, corner=corner, size=size, 
-                     npoints=npoints)
+                     npoints=npoints, tile=tile)
 
-        # Clamping of the `to` image including padding with -1
-        data, to_bins_adjusted = clamp(to_img,
-                                       to_bins,
-                                       mask=to_mask,
-                                       sigma=self._to_sigma)
-        if not similarity == 'slr':
-            to_bins = to_bins_adjusted
-        self._to_data = -np.ones(np.array(to_img.shape) + 2, dtype=CLAMP_DTYPE)
-        self._to_data[1:-1, 1:-1, 1:-1] = data
-        self._to_inv_affine = inverse_affine(to_img.get_affine())
+        # Clamping of the `to` image including padding with masked
+        # voxels, unless a preprocessed template is given
+        if isinstance(to_img, Template):
+            template = to_img
+        else:
+            template = Template(to_img, to_bins, mask=to_mask,
+                                sigma=self._to_sigma, brick=brick,
+                                cache=cache)
+        self._level_args.update(to_img=template.img, to_mask=template.mask,
+                                brick=template.brick,
+                                bins=(unpack(bins, int)[0],
+                                      template.nominal_bins))
+        self._to_sigma = template.sigma
+        if similarity == 'slr':
+            to_bins = template.nominal_bins
+        else:
+            to_bins = template.bins
+        self._to_data = template.data
+        self._to_layout = template.layout
+        self._to_occupancy = template.occupancy
+        self._to_inv_affine = template.inv_affine
 
         # Joint histogram: must be double contiguous as it will be
-        # passed to C routines which assume so
-        self._joint_hist = np.zeros([from_bins, to_bins], dtype='double')
+        # passed to C routines which assume so. It is allocated on
+        # first use as measures computed from intensity moments do not
+        # need it.
+        self._bins = (from_bins, to_bins)
+        self._hist = None
+        self._joint_hist_gradient = None
+        self._hashed_hist = None
+        self._counts_hist = None
+        self.hashed = bool(hashed)
+        # Arrays reused across similarity evaluations: thread-private
+        # histograms, moments, batch histograms and coordinate
+        # buffers, see `_workspace_array`
+        self._workspace = {}
 
         # Set default registration parameters
+        self.nthreads = int(nthreads)
+        self.fixed_point = bool(fixed_point)
+        self._set_sampling(sampling)
+        self.nsamples = nsamples
+        self._sampling_seed = None
         self._set_interp(interp)
         self._set_similarity(similarity, renormalize, dist=dist)
 
+    def _get_joint_hist(self):
+        if self._hist is None:
+            self._hist = np.zeros(self._bins, dtype='double')
+        return self._hist
+
+    _joint_hist = property(_get_joint_hist)
+
     def _get_interp(self):
         return list(interp_methods.keys())[\
             list(interp_methods.values()).index(self._interp)]
@@ -153,8 +362,51 @@ class HistogramRegistration(object):
 
     interp = property(_get_interp, _set_interp)
 
+    def _interp_arg(self):
+        """
+        Interpolation argument for the joint histogram routines. In
+        random interpolation mode, this is minus a seed drawn at
+        random.
+        """
+        if self._interp >= 0:
+            return self._interp
+        return -1 - np.random.randint(MAX_SEED)
+
+    def _get_sampling(self):
+        if self._sampling == 0:
+            return None
+        return list(sampling_methods.keys())[\
+            list(sampling_methods.values()).index(self._sampling)]
+
+    def _set_sampling(self, sampling):
+        if sampling is None:
+            self._sampling = 0
+        else:
+            self._sampling = sampling_methods[sampling]
+
+    sampling = property(_get_sampling, _set_sampling)
+
+    def _sampling_args(self):
+        """
+        Source sampling arguments for the joint histogram routines,
+        and scaling factor to be applied to the resulting joint
+        histogram so that its mass does not depend on the number of
+        draws.
+        """
+        if self._sampling == 0:
+            return {}, 1
+        nsamples = self.nsamples
+        if nsamples is None:
+            nsamples = min(NPOINTS, self._from_npoints)
+        seed = self._sampling_seed
+        if seed is None:
+            seed = np.random.randint(MAX_SEED)
+        args = {'sampling': self._sampling, 'nsamples': int(nsamples),
+                'seed': seed}
+        return args, self._from_npoints / float(max(nsamples, 1))
+
     def set_fov(self, spacing=None, corner=(0, 0, 0), size=None,
-                npoints=None):
+                npoints=None, tile=None):
         """
         Defines a subset of the `from` image to restrict joint
         histogram computation.
@@ -172,6 +424,14 @@ class HistogramRegistration(object):
         npoints : positive integer
           Desired number of voxels in the bounding box. If a `spacing`
           argument is provided, then `npoints` is ignored.
+        tile : None or positive integer
+          If not None, voxels are visited by cubic tiles of side
+          `tile`, e.g. 8, rather than in C order when computing the
+          joint histogram. Transformed voxels then reach the `to`
+          image in a more cache friendly order under large
+          rotations. Joint histograms are unchanged up to rounding
+          errors, except in stochastic modes where samples are drawn
+          along the traversal order.
         """
         if spacing is None and npoints is None:
             spacing = [1, 1, 1]
@@ -187,13 +447,18 @@ class HistogramRegistration(object):
             spacing = ideal_spacing(fov_data, npoints=npoints)
             fov_data = self._from_img.get_data()[slicer(corner, size, spacing)]
         self._from_data = fov_data
-        self._from_npoints = (fov_data >= 0).sum()
         self._from_affine = subgrid_affine(self._from_img.get_affine(),
                                            slicer(corner, size, spacing))
-        # We cache the voxel coordinates of the clamped image
         self._from_spacing = spacing
-        self._vox_coords =\
-            np.indices(self._from_data.shape).transpose((1, 2, 3, 0))
+        # We cache a packed list of the unmasked voxels in the field of
+        # view: their intensities and their grid coordinates stored as
+        # a (3, N) array, which is all the joint histogram routines
+        # need to see
+        if tile is None:
+            tile = 0
+        self._from_values, self._from_coords = _samples(fov_data, int(tile))
+        self._from_npoints = self._from_values.size
+        self._vox_coords = self._from_coords.T
 
     def _set_similarity(self, similarity, renormalize=False, dist=None):
         if similarity in builtin_simi:
@@ -201,11 +466,11 @@ class HistogramRegistration(object):
                 if dist is None:
                     raise ValueError('slr measure requires a joint intensity distribution model, '
                                      'see `dist` argument of HistogramRegistration')
-                if dist.shape != self._joint_hist.shape:
+                if dist.shape != self._bins:
                     raise ValueError('Wrong shape for the `dist` argument')
             self._similarity = similarity
             self._similarity_call =\
-                builtin_simi[similarity](self._joint_hist.shape,
+                builtin_simi[similarity](self._bins,
                                          self._from_npoints,
                                          renormalize=renormalize,
                                          dist=dist)
@@ -232,15 +497,47 @@ class HistogramRegistration(object):
         Tv = ChainTransform(T, pre=self._from_affine, post=self._to_inv_affine)
         return self._eval(Tv)
 
+    def eval_batch(self, T, params):
+        """
+        Evaluate similarity function at several world-to-world
+        transforms sharing the type of `T`.
+
+        If `T` is affine, the joint histograms are computed in a
+        single pass over the `from` image for up to `BATCH_SIZE`
+        transforms at a time (fewer if the histograms would exceed
+        `BATCH_BYTES` in total). The input transformation object `T` is
+        modified in place unless it has a ``copy`` method.
+
+        Parameters
+        ----------
+        T : Transform
+            Transform object implementing ``apply`` method
+        params : array-like
+            Array of shape (K, n) where each row specifies the
+            parameters of a transform
+
+        Returns
+        -------
+        s : ndarray
+            Array of K similarity values
+        """
+        if hasattr(T, 'copy'):
+            T = T.copy()
+        Tv = ChainTransform(T, pre=self._from_affine, post=self._to_inv_affine)
+        return self._eval_batch(Tv, np.atleast_2d(params))
+
     def eval_gradient(self, T, epsilon=1e-1):
         """
         Evaluate the gradient of the similarity function wrt
         transformation parameters.
 
-        The gradient is approximated using central finite differences
-        at the transformation specified by `T`. The input
-        transformation object `T` is modified in place unless it has a
-        ``copy`` method.
+        If `T` is affine, the interpolation method is 'pv' or
+        'parzen' and the similarity measure implements a ``gradient``
+        method, the gradient is computed analytically in a single pass
+        over the source image. Otherwise, it is approximated using central
+        finite differences at the transformation specified by
+        `T`. The input transformation object `T` is modified in place
+        unless it has a ``copy`` method.
 
         Parameters
         ----------
@@ -259,11 +556,14 @@ class HistogramRegistration(object):
         if hasattr(T, 'copy'):
             T = T.copy()
 
-        def simi(param):
-            T.param = param
-            return self.eval(T)
+        Tv = ChainTransform(T, pre=self._from_affine, post=self._to_inv_affine)
+        if self._has_gradient(Tv):
+            return self._eval_gradient(Tv)[1]
+
+        def simis(params):
+            return self.eval_batch(T, params)
 
-        return approx_gradient(simi, param0, epsilon)
+        return approx_gradient(simis, param0, epsilon, batch=True)
 
     def eval_hessian(self, T, epsilon=1e-1, diag=False):
         """
@@ -272,8 +572,10 @@ class HistogramRegistration(object):
 
         The Hessian or its diagonal is approximated at the
         transformation specified by `T` using central finite
-        differences. The input transformation object `T` is modified
-        in place unless it has a ``copy`` method.
+        differences, either of the analytic gradient if available (see
+        `eval_gradient`) or of the similarity function. The input
+        transformation object `T` is modified in place unless it has a
+        ``copy`` method.
 
         Parameters
         ----------
@@ -294,14 +596,170 @@ class HistogramRegistration(object):
         if hasattr(T, 'copy'):
             T = T.copy()
 
-        def simi(param):
-            T.param = param
-            return self.eval(T)
+        Tv = ChainTransform(T, pre=self._from_affine, post=self._to_inv_affine)
+        if self._has_gradient(Tv):
+
+            def grad(param):
+                Tv.param = param
+                return self._eval_gradient(Tv)[1]
+
+            H = approx_jacobian(grad, param0, epsilon)
+            H = .5 * (H + H.T)
+            if diag:
+                return np.diag(np.diag(H))
+            return H
+
+        def simis(params):
+            return self.eval_batch(T, params)
 
         if diag:
-            return np.diag(approx_hessian_diag(simi, param0, epsilon))
+            return np.diag(approx_hessian_diag(simis, param0, epsilon,
+                                               batch=True))
         else:
-            return approx_hessian(simi, param0, epsilon)
+            return approx_hessian(simis, param0, epsilon, batch=True)
+
+    def _has_gradient(self, Tv):
+        """
+        Check whether the similarity gradient wrt the parameters of
+        voxel-to-voxel transform `Tv` can be computed analytically.
+        """
+        if not self._interp in (interp_methods['pv'],
+                                interp_methods['parzen']):
+            return False
+        if getattr(self._similarity_call, 'gradient', None) is None:
+            return False
+        return voxel_affine(Tv) is not None
+
+    def _eval_gradient(self, Tv):
+        """
+        Evaluate the similarity function and its gradient wrt the
+        parameters of an affine voxel-to-voxel transform using partial
+        volume or Parzen window interpolation.
+
+        Parameters
+        ----------
+        Tv : ChainTransform
+             Affine transform mapping voxel space to voxel space
+
+        Returns
+        -------
+        s : float
+            Similarity value
+        g : ndarray
+            Similarity gradient wrt ``Tv.param``
+        """
+        if self._joint_hist_gradient is None:
+            self._joint_hist_gradient =\
+                np.zeros(self._bins + (12,), dtype='double')
+        G = self._joint_hist_gradient
+        H = self._joint_hist
+        sampling_args, scale = self._sampling_args()
+        _joint_histogram_gradient(H,
+                                  G,
+                                  (self._from_values, self._from_coords),
+                                  self._to_data,
+                                  voxel_affine(Tv),
+                                  self.nthreads,
+                                  layout=self._to_layout,
+                                  occupancy=self._to_occupancy,
+                                  interp=self._interp,
+                                  workspace=self._workspace,
+                                  **sampling_args)
+        if scale != 1:
+            H *= scale
+            G *= scale
+        np.maximum(H, 0, H)
+        s = self._similarity_call(H)
+        dsdH = self._similarity_call.gradient(H)
+        dsdA = np.dot(dsdH.ravel(), G.reshape((-1, 12)))
+        return s, np.dot(dsdA, voxel_affine_jacobian(Tv))
+
+    def _from_moments(self):
+        """
+        Check whether the similarity function is computed from the
+        moments of the target intensity given the source intensity,
+        which the joint histogram routines can accumulate in place of
+        the joint histogram.
+        """
+        return getattr(self._similarity_call, 'from_moments', None) is not None
+
+    def _from_hashed(self):
+        """
+        Check whether the similarity function is computed from a hashed
+        histogram, see `hashed`. Moments are preferred when the
+        similarity function supports both.
+        """
+        return self.hashed and not self._from_moments() and\
+            not self._interp == interp_methods['parzen'] and\
+            getattr(self._similarity_call, 'from_hashed', None) is not None
+
+    def _from_counts(self):
+        """
+        Check whether the similarity function is computed from integer
+        counts, which random interpolation accumulates with half the
+        memory of doubles and without per-thread histogram copies.
+        """
+        return self._interp == interp_methods['rand'] and\
+            not self._from_moments() and\
+            getattr(self._similarity_call, 'from_counts', None) is not None
+
+    def _eval_counts(self, trans_vox_coords, interp, sampling_args, scale):
+        """
+        Evaluate similarity function from a count histogram given
+        transformed voxel coordinates or a voxel-to-voxel affine.
+        """
+        if self._counts_hist is None:
+            self._counts_hist = np.zeros(self._bins, dtype='uint32')
+        C = _joint_histogram(self._counts_hist,
+                             (self._from_values, self._from_coords),
+                             self._to_data,
+                             trans_vox_coords,
+                             interp,
+                             self.nthreads,
+                             layout=self._to_layout,
+                             occupancy=self._to_occupancy,
+                             workspace=self._workspace,
+                             **sampling_args)
+        return self._similarity_call.from_counts(C, scale)
+
+    def _eval_hashed(self, trans_vox_coords, interp, sampling_args, scale):
+        """
+        Evaluate similarity function from a hashed histogram given
+        transformed voxel coordinates or a voxel-to-voxel affine.
+        """
+        if self._hashed_hist is None:
+            self._hashed_hist = _hashed_histogram(HASHED_ENTRIES)
+        T = _joint_histogram(self._hashed_hist,
+                             (self._from_values, self._from_coords),
+                             self._to_data,
+                             trans_vox_coords,
+                             interp,
+                             self.nthreads,
+                             layout=self._to_layout,
+                             occupancy=self._to_occupancy,
+                             hashed=True,
+                             workspace=self._workspace,
+                             **sampling_args)
+        # Keep the table grown to fit
+        self._hashed_hist = T
+        h = T[:-1, 1]
+        if scale != 1:
+            h *= scale
+        np.maximum(h, 0, h)
+        return self._similarity_call.from_hashed(T)
+
+    def _transformed_coords(self, Tv):
+        """
+        Voxel coordinates transformed by a non-affine voxel-to-voxel
+        transform as a double C-contiguous array, copied into a
+        workspace buffer unless the transform already returns one.
+        """
+        coords = Tv.apply(self._vox_coords)
+        if coords.dtype == np.double and coords.flags['C_CONTIGUOUS']:
+            return coords
+        out = _workspace_array(self._workspace, 'coords', coords.shape)
+        out[...] = coords
+        return out
 
     def _eval(self, Tv):
         """
@@ -313,22 +771,134 @@ class HistogramRegistration(object):
              Transform object implementing ``apply`` method
              Should map voxel space to voxel space
         """
+        # If the transform is affine, the joint histogram routine
+        # transforms the voxel coordinates on the fly. Otherwise,
         # trans_vox_coords needs be C-contiguous
-        trans_vox_coords = Tv.apply(self._vox_coords)
-        interp = self._interp
-        if self._interp < 0:
-            interp = - np.random.randint(MAX_INT)
-        _joint_histogram(self._joint_hist,
-                         self._from_data.flat,  # array iterator
+        trans_vox_coords = voxel_affine(Tv)
+        if trans_vox_coords is None:
+            trans_vox_coords = self._transformed_coords(Tv)
+        if self.fixed_point:
+            trans_vox_coords = _fixed_point(
+                trans_vox_coords,
+                out=_workspace_array(self._workspace, 'fixed_point',
+                                     trans_vox_coords.shape, np.intc))
+        interp = self._interp_arg()
+        sampling_args, scale = self._sampling_args()
+        if self._from_hashed():
+            return self._eval_hashed(trans_vox_coords, interp,
+                                     sampling_args, scale)
+        if self._from_counts():
+            return self._eval_counts(trans_vox_coords, interp,
+                                     sampling_args, scale)
+        moments = self._from_moments()
+        if moments:
+            H = _workspace_array(self._workspace, 'moments',
+                                 (self._bins[0], 3))
+        else:
+            H = self._joint_hist
+        _joint_histogram(H,
+                         (self._from_values, self._from_coords),
                          self._to_data,
                          trans_vox_coords,
-                         interp)
+                         interp,
+                         self.nthreads,
+                         moments=moments,
+                         layout=self._to_layout,
+                         occupancy=self._to_occupancy,
+                         workspace=self._workspace,
+                         **sampling_args)
+        if scale != 1:
+            H *= scale
         # Make sure all joint histogram entries are non-negative
-        np.maximum(self._joint_hist, 0, self._joint_hist)
-        return self._similarity_call(self._joint_hist)
+        np.maximum(H, 0, H)
+        if moments:
+            return self._similarity_call.from_moments(H)
+        return self._similarity_call(H)
+
+    def _eval_batch(self, Tv, params):
+        """
+        Evaluate similarity function at several voxel-to-voxel
+        transforms.
+
+        Parameters
+        ----------
+        Tv : ChainTransform
+             Transform mapping voxel space to voxel space. Its
+             parameters are modified during computation and then
+             restored.
+        params : sequence
+             Sequence of parameter vectors for `Tv`
+
+        Returns
+        -------
+        s : ndarray
+            Array of similarity values
+        """
+        param0 = Tv.param
+        As = []
+        for p in params:
+            Tv.param = p
+            As.append(voxel_affine(Tv))
+        # Non-affine transforms are evaluated one at a time, and so
+        # are hashed histograms, which the batch routine does not
+        # support
+        if len(As) == 0 or As[0] is None or self._from_hashed():
+            simis = []
+            for p in params:
+                Tv.param = p
+                simis.append(self._eval(Tv))
+            Tv.param = param0
+            return np.array(simis)
+        Tv.param = param0
+        # All transforms are evaluated on the same source samples,
+        # and the same random numbers in random interpolation mode
+        sampling_args, scale = self._sampling_args()
+        interp = self._interp_arg()
+        simis = np.zeros(len(As))
+        # Count histograms are not supported by the batch routine
+        # either, so the same kernel as in `_eval` is run for each
+        # transform, with the random numbers drawn above
+        if self._from_counts():
+            for k, A in enumerate(As):
+                if self.fixed_point:
+                    A = _fixed_point(A)
+                simis[k] = self._eval_counts(A, interp, sampling_args, scale)
+            return simis
+        moments = self._from_moments()
+        if moments:
+            shape = (self._bins[0], 3)
+        else:
+            shape = self._bins
+        size = max(1, min(BATCH_SIZE, BATCH_BYTES // (8 * np.prod(shape))))
+        Hs = _workspace_array(self._workspace, 'batch', (size,) + shape)
+        for k0 in range(0, len(As), size):
+            Ak = np.array(As[k0:k0 + size])
+            if self.fixed_point:
+                Ak = _fixed_point(Ak)
+            H = Hs[0:Ak.shape[0]]
+            _joint_histogram_batch(H,
+                                   (self._from_values, self._from_coords),
+                                   self._to_data,
+                                   Ak,
+                                   interp,
+                                   self.nthreads,
+                                   moments=moments,
+                                   layout=self._to_layout,
+                                   occupancy=self._to_occupancy,
+                                   workspace=self._workspace,
+                                   **sampling_args)
+            if scale != 1:
+                H *= scale
+            np.maximum(H, 0, H)
+            for k in range(Ak.shape[0]):
+                if moments:
+                    simis[k0 + k] = self._similarity_call.from_moments(H[k])
+                else:
+                    simis[k0 + k] = self._similarity_call(H[k])
+        return simis
 
     def optimize(self, T, optimizer='powell', xtol=1e-2, ftol=1e-2, gtol=1e-3,
-                 maxiter=25, maxfun=None, **kwargs):
+                 maxiter=25, maxfun=None, pyramid=None, **kwargs):
         """ Optimize transform `T` with respect to similarity measure.
 
         The input object `T` will change as a result of the optimization.
@@ -344,6 +914,19 @@ class HistogramRegistration(object):
         optimizer : str
           Name of optimization function (one of 'powell', 'steepest',
           'cg', 'bfgs', 'simplex')
+        pyramid : None, int or sequence of dict
+          If not None, `T` is first optimized at coarser resolutions,
+          each level starting from the transformation found at the
+          previous one, before the final optimization. If a sequence,
+          it describes the coarse levels in coarse to fine order: the
+          'spacing', 'sigma' and 'bins' keys, if present, override
+          the registration settings of the same names, see
+          `__init__`, and the remaining keys override the optimizer
+          arguments, e.g. 'xtol' or 'maxiter'. An integer n stands
+          for n - 1 levels with spacing 2**k times the current one
+          and smoothing of 2**(k-1) voxels, k = n-1, ..., 1, and
+          tolerances scaled by 2**k. Clamped images are computed
+          once per level and reused across calls.
         **kwargs : dict
           keyword arguments to pass to optimizer
 
@@ -356,6 +939,23 @@ class HistogramRegistration(object):
         if T in affine_transforms:
             T = affine_transforms[T]()
 
+        # Coarse to fine pre-optimization
+        if pyramid is not None:
+            if not hasattr(pyramid, '__iter__'):
+                pyramid = self._default_pyramid(int(pyramid), xtol, ftol)
+            for level in pyramid:
+                level = dict(level)
+                reg = self._pyramid_level(spacing=level.pop('spacing', None),
+                                          sigma=level.pop('sigma', None),
+                                          bins=level.pop('bins', None))
+                args = dict(optimizer=optimizer, xtol=xtol, ftol=ftol,
+                            gtol=gtol, maxiter=maxiter, maxfun=maxfun)
+                args.update(kwargs)
+                args.update(level)
+                if VERBOSE:
+                    print('Pyramid level: spacing %s' % (reg._from_spacing,))
+                T = reg.optimize(T, **args)
+
         # Pull callback out of keyword arguments, if present
         callback = kwargs.pop('callback', None)
 
@@ -378,6 +978,18 @@ class HistogramRegistration(object):
                 print(str(self.similarity) + ' = %s' % self._eval(Tv))
                 print('')
 
+        # In stochastic sampling mode, the source samples are kept
+        # fixed within each iteration, so that line searches see a
+        # consistent cost function, and redrawn after each iteration
+        if self._sampling > 0:
+            iter_callback = callback
+            self._sampling_seed = np.random.randint(MAX_SEED)
+
+            def callback(tc):
+                if iter_callback is not None:
+                    iter_callback(tc)
+                self._sampling_seed = np.random.randint(MAX_SEED)
+
         # Switching to the appropriate optimizer
         if VERBOSE:
             print('Initial guess...')
@@ -389,8 +1001,16 @@ class HistogramRegistration(object):
         kwargs.setdefault('maxiter', maxiter)
         kwargs.setdefault('maxfun', maxfun)
 
+        # Use analytic gradients if possible
+        fprime = None
+        if use_derivatives(optimizer) and self._has_gradient(Tv):
+
+            def fprime(tc):
+                Tv.param = tc
+                return -self._eval_gradient(Tv)[1]
+
         fmin, args, kwargs = configure_optimizer(optimizer,
-                                                 fprime=None,
+                                                 fprime=fprime,
                                                  fhess=None,
                                                  **kwargs)
 
@@ -398,10 +1018,103 @@ class HistogramRegistration(object):
         if VERBOSE:
             print('Optimizing using %s' % fmin.__name__)
         kwargs['callback'] = callback
-        Tv.param = fmin(cost, tc0, *args, **kwargs)
+        try:
+            Tv.param = fmin(cost, tc0, *args, **kwargs)
+        finally:
+            self._sampling_seed = None
         return Tv.optimizable
 
-    def explore(self, T, *args):
+    def _default_pyramid(self, nlevels, xtol, ftol):
+        """
+        Coarse levels of an `nlevels` levels pyramid, see `optimize`.
+        """
+        from_vox = voxel_size(self._from_img)
+        to_vox = voxel_size(self._level_args['to_img'])
+        pyramid = []
+        for k in range(nlevels - 1, 0, -1):
+            f = 2 ** k
+            sigma = (max(self._from_sigma, .5 * f * from_vox),
+                     max(self._to_sigma, .5 * f * to_vox))
+            pyramid.append({'spacing': [f * s for s in self._from_spacing],
+                            'sigma': sigma,
+                            'xtol': f * xtol,
+                            'ftol': f * ftol})
+        return pyramid
+
+    def _pyramid_level(self, spacing=None, sigma=None, bins=None):
+        """
+        Registration object with the same images and settings as
+        `self` except for the `spacing`, `sigma` and `bins` arguments,
+        where None means unchanged. Objects are cached so that images
+        are clamped and smoothed only once per level.
+        """
+        if spacing is None:
+            spacing = self._from_spacing
+        spacing = tuple(int(s) for s in np.resize(spacing, 3))
+        if sigma is None:
+            sigma = (self._from_sigma, self._to_sigma)
+        sigma = unpack(sigma, float)
+        if bins is None:
+            bins = self._level_args['bins']
+        bins = unpack(bins, int)
+        key = (spacing, sigma, bins)
+        reg = self._levels.get(key)
+        if reg is None:
+            args = dict(self._level_args, spacing=spacing, sigma=sigma,
+                        bins=bins)
+            reg = HistogramRegistration(**args)
+            self._levels[key] = reg
+        # Runtime settings may have changed since construction
+        reg.nthreads = self.nthreads
+        reg._interp = self._interp
+        reg._sampling = self._sampling
+        reg.nsamples = self.nsamples
+        reg.fixed_point = self.fixed_point
+        reg.hashed = self.hashed
+        return reg
+
+    def _worker(self):
+        """
+        Copy of the registration object sharing its images and
+        settings, but with private histograms and workspace, so that
+        several copies can evaluate similarities concurrently. Copies
+        compute joint histograms in a single thread, as they are
+        meant to run in worker threads themselves.
+        """
+        reg = copy.copy(self)
+        reg._hist = None
+        reg._joint_hist_gradient = None
+        reg._hashed_hist = None
+        reg._counts_hist = None
+        reg._workspace = {}
+        reg._levels = {}
+        reg._sampling_seed = None
+        reg.nthreads = 1
+        return reg
+
+    def _map_workers(self, func, items, nworkers):
+        """
+        Return ``[func(reg, item) for item in items]``, where the items
+        are split into `nworkers` contiguous blocks processed
+        concurrently by private copies `reg` of the registration
+        object, see `_worker`. The joint histogram routines release
+        the GIL, so that workers run in parallel most of the time.
+        """
+        nworkers = max(1, min(int(nworkers), len(items)))
+        if nworkers == 1:
+            return [func(self, item) for item in items]
+        bounds = _split(len(items), nworkers)
+
+        def work(b):
+            reg = self._worker()
+            return [func(reg, item) for item in items[bounds[b]:bounds[b + 1]]]
+
+        out = []
+        for res in _thread_pool(nworkers).map(work, range(nworkers)):
+            out += res
+        return out
+
+    def explore(self, T, *args, **kwargs):
         """
         Evaluate the similarity at the transformations specified by
         sequences of parameter values.
@@ -421,6 +1134,10 @@ class HistogramRegistration(object):
           the first element specifies a transformation parameter axis
           and the second element gives the successive parameter values
           to evaluate along that axis.
+        nworkers : int
+          Number of threads the transformations are spread across,
+          each evaluating its share in batches, see `eval_batch`. Only
+          used if `T` has a ``copy`` method.
 
         Returns
         -------
@@ -429,6 +1146,10 @@ class HistogramRegistration(object):
         p : ndarray
           Corresponding array of evaluated transformation parameters
         """
+        nworkers = kwargs.pop('nworkers', 1)
+        if kwargs:
+            raise TypeError('unexpected keyword arguments: %s'
+                            % ', '.join(kwargs))
         nparams = T.param.size
         if hasattr(T, 'copy'):
             T = T.copy()
@@ -446,13 +1167,286 @@ class HistogramRegistration(object):
                             post=self._to_inv_affine)
         param0 = Tv.param
         for i in range(ntrials):
-            param = param0 + np.array([D[i] for D in Deltas])
-            Tv.param = param
-            simis[i] = self._eval(Tv)
-            params[:, i] = param
+            params[:, i] = param0 + np.array([D[i] for D in Deltas])
+        if nworkers > 1 and hasattr(T, 'copy'):
+            # Each worker evaluates a contiguous block of trials in
+            # batches, using its own copy of T
+            nworkers = min(nworkers, ntrials)
+            bounds = _split(ntrials, nworkers)
+            blocks = [params[:, bounds[b]:bounds[b + 1]].T
+                      for b in range(nworkers)]
+
+            def eval_block(reg, block):
+                Tb = ChainTransform(T.copy(), pre=reg._from_affine,
+                                    post=reg._to_inv_affine)
+                return reg._eval_batch(Tb, block)
+
+            simis[:] = np.concatenate(
+                self._map_workers(eval_block, blocks, nworkers))
+        else:
+            simis[:] = self._eval_batch(Tv, params.T)
 
         return simis, params
 
+    def search(self, T, *args, **kwargs):
+        """
+        Global search: evaluate the similarity on a grid of
+        transformations as in `explore`, then run local optimizations
+        concurrently from the best grid points, and return the best
+        optimum found.
+
+        For instance, to search rotations about the x axis in steps
+        of about 20 degrees before refining the three best candidates:
+
+        T = search('rigid', (3, np.linspace(-.5, .5, 6)), nstarts=3)
+
+        Parameters
+        ----------
+        T : object or str
+          Transformation around which the grid is defined, or a string
+          as in `optimize`. It is not modified, and should have a
+          ``copy`` method.
+        args : tuple
+          Grid specification, see `explore`.
+        nstarts : int
+          Number of best grid points used as starting points of local
+          optimizations.
+        nworkers : int
+          Number of threads used for both the grid exploration and the
+          local optimizations.
+        **kwargs : dict
+          Keyword arguments passed to `optimize`.
+
+        Returns
+        -------
+        T : object
+          Best locally optimal transformation
+        """
+        nstarts = int(kwargs.pop('nstarts', 1))
+        nworkers = int(kwargs.pop('nworkers', 1))
+        if T in affine_transforms:
+            T = affine_transforms[T]()
+        simis, params = self.explore(T, *args, nworkers=nworkers)
+        best = np.argsort(-simis)[:nstarts]
+
+        def refine(reg, p):
+            Tk = T.copy()
+            Tk.param = p
+            Tk = reg.optimize(Tk, **kwargs)
+            return reg.eval(Tk), Tk
+
+        results = self._map_workers(refine, [params[:, k] for k in best],
+                                    nworkers)
+        return max(results, key=lambda r: r[0])[1]
+
+
+def register_batch(from_imgs, to_img, T='affine', from_masks=None,
+                   to_mask=None, nworkers=1, optimize_args=None, **kwargs):
+    """
+    Register several `from` images to a common `to` image, typically a
+    template.
+
+    The `to` image is preprocessed once into a `Template` shared
+    read-only by all registrations, which are scheduled across
+    `nworkers` threads, each thread picking the next pending image
+    when done with the previous one. The joint histogram routines
+    release the GIL, so that threads run concurrently most of the
+    time.
+
+    Parameters
+    ----------
+    from_imgs : sequence of nibabel images
+      `From` images
+    to_img : nibabel image or Template
+      Common `to` image
+    T : str or object
+      Initial transformation, copied for each registration, or name
+      of a transformation class, see `HistogramRegistration.optimize`
+    from_masks : None or sequence
+      Masks of the `from` images
+    to_mask : None or array-like
+      Mask of the `to` image
+    nworkers : int
+      Number of registrations run concurrently
+    optimize_args : None or dict
+      Keyword arguments passed to `HistogramRegistration.optimize`
+    **kwargs : dict
+      Keyword arguments passed to `HistogramRegistration`, e.g.
+      `bins`, `sigma` or `similarity`. Each registration uses
+      `nthreads` threads, one by default.
+
+    Returns
+    -------
+    Ts : list
+      Optimized transformations
+    times : ndarray
+      Wall-clock durations in seconds of the setup and of the
+      optimization of each registration, as a (len(from_imgs), 2)
+      array
+    """
+    if not isinstance(to_img, Template):
+        to_img = Template(to_img,
+                          unpack(kwargs.get('bins', 256), int)[1],
+                          mask=to_mask,
+                          sigma=unpack(kwargs.get('sigma', 0), float)[1],
+                          brick=kwargs.get('brick'),
+                          cache=kwargs.get('cache'))
+    if from_masks is None:
+        from_masks = [None] * len(from_imgs)
+    if optimize_args is None:
+        optimize_args = {}
+
+    def job(k):
+        t0 = time.time()
+        R = HistogramRegistration(from_imgs[k], to_img,
+                                  from_mask=from_masks[k], **kwargs)
+        t1 = time.time()
+        if T in affine_transforms:
+            Tk = affine_transforms[T]()
+        else:
+            Tk = T.copy()
+        Tk = R.optimize(Tk, **optimize_args)
+        return Tk, (t1 - t0, time.time() - t1)
+
+    if nworkers > 1:
+        # A private pool, as registrations may use the shared pools
+        # of the joint histogram routines themselves
+        pool = ThreadPool(nworkers)
+        try:
+            results = list(pool.imap(job, range(len(from_imgs))))
+        finally:
+            pool.close()
+            pool.join()
+    else:
+        results = [job(k) for k in range(len(from_imgs))]
+    return [r[0] for r in results], np.array([r[1] for r in results])
+
+
+def voxel_affine(Tv):
+    """
+    Voxel-to-voxel affine matrix of a chain transform.
+
+    Parameters
+    ----------
+    Tv : ChainTransform
+      Transform mapping source voxel space to target voxel space
+
+    Returns
+    -------
+    A : ndarray or None
+      C-contiguous (3, 4) array representing the upper part of the
+      composed affine matrix if the optimizable, pre and post
+      transforms are all affine, None otherwise
+    """
+    pieces = (Tv.post, Tv.optimizable, Tv.pre)
+    if not np.all([hasattr(t, 'as_affine') for t in pieces]):
+        return None
+    A = np.dot(pieces[0].as_affine(),
+               np.dot(pieces[1].as_affine(), pieces[2].as_affine()))
+    return np.ascontiguousarray(A[0:3], dtype='double')
+
+
+def voxel_affine_jacobian(Tv, epsilon=1e-5):
+    """
+    Jacobian of the voxel-to-voxel affine matrix of a chain transform
+    wrt its parameters.
+
+    This only involves composing 4x4 matrices, so it is approximated
+    by central finite differences at negligible cost.
+
+    Parameters
+    ----------
+    Tv : ChainTransform
+      Affine transform mapping source voxel space to target voxel
+      space. Its parameters are modified during computation and then
+      restored.
+    epsilon : float
+      Stepsize for finite differences
+
+    Returns
+    -------
+    J : ndarray
+      Array of shape (12, n) where n is the number of parameters
+    """
+    param0 = Tv.param
+    J = np.zeros((12, param0.size))
+    ei = np.zeros(param0.size)
+    for i in range(param0.size):
+        ei[i] = epsilon
+        Tv.param = param0 + ei
+        Ap = voxel_affine(Tv)
+        Tv.param = param0 - ei
+        Am = voxel_affine(Tv)
+        J[:, i] = (Ap - Am).ravel() / (2 * epsilon)
+        ei[i] = 0
+    Tv.param = param0
+    return J
+
+
+def voxel_size(img):
+    """
+    Mean voxel size in millimeters of an image.
+    """
+    return np.mean(np.sqrt(np.sum(img.get_affine()[0:3, 0:3] ** 2, 0)))
+
+
+def image_key(img, mask, *params):
+    """
+    Hexadecimal digest identifying an image by its data, affine and
+    mask, together with arbitrary parameters of its preprocessing,
+    for use with `cached_arrays`.
+    """
+    data = np.ascontiguousarray(img.get_data())
+    h = hashlib.sha1()
+    h.update(repr((CACHE_VERSION, data.dtype.str, data.shape,
+                   params)).encode('ascii'))
+    h.update(data)
+    h.update(np.ascontiguousarray(img.get_affine(), dtype='double'))
+    if mask is not None:
+        h.update(np.ascontiguousarray(mask, dtype='bool'))
+    return h.hexdigest()
+
+
+def cached_arrays(cache, key, func):
+    """
+    Return the sequence of arrays computed by ``func()``, which are
+    stored in the `cache` directory as files ``key.0.npy``,
+    ``key.1.npy`` and so on. If these files exist, they are instead
+    memory-mapped read-only, so that processes using the same arrays
+    share their pages. If `cache` is None, ``func()`` is returned.
+
+    Files are written under temporary names and renamed, the first
+    one last, so that concurrent processes or threads never read
+    partial entries.
+    """
+    if cache is None:
+        return func()
+    path = os.path.join(cache, key)
+    names = lambda n: ['%s.%d.npy' % (path, i) for i in range(n)]
+    if os.path.exists(names(1)[0]):
+        try:
+            n = int(np.load(names(1)[0]))
+            return [np.load(f, mmap_mode='r') for f in names(n + 1)[1:]]
+        except (IOError, OSError, ValueError):
+            pass
+    arrays = func()
+    try:
+        os.makedirs(cache)
+    except OSError:
+        # Possibly created concurrently by another worker
+        if not os.path.isdir(cache):
+            raise
+    # The first file holds the number of arrays and is written last
+    files = names(len(arrays) + 1)
+    contents = [np.array(len(arrays))] + list(arrays)
+    for f, a in reversed(list(zip(files, contents))):
+        tmp = '%s.%d.%d.tmp' % (f, os.getpid(),
+                                threading.current_thread().ident)
+        with open(tmp, 'wb') as fp:
+            np.save(fp, np.asarray(a))
+        _replace(tmp, f)
+    return arrays
+
 
 def ideal_spacing(data, npoints):
     """
@@ -472,7 +1466,7 @@ def ideal_spacing(data, npoints):
       Spacing factors
     """
     dims = data.shape
-    actual_npoints = (data >= 0).sum()
+    actual_npoints = _unmasked(data).sum()
     spacing = np.ones(3, dtype='uint')
 
     while actual_npoints > npoints:
@@ -487,7 +1481,7 @@ def ideal_spacing(data, npoints):
             dir = 2
         spacing[dir] += 1
         subdata = data[::spacing[0], ::spacing[1], ::spacing[2]]
-        actual_npoints = (subdata >= 0).sum()
+        actual_npoints = _unmasked(subdata).sum()
 
     return spacing
 
@@ -514,7 +1508,7 @@ def smallest_bounding_box(msk):
     return corner, size
 
 
-def approx_gradient(f, x, epsilon):
+def approx_gradient(f, x, epsilon, batch=False):
     """
     Approximate the gradient of a function using central finite
     differences
@@ -527,6 +1521,10 @@ def approx_gradient(f, x, epsilon):
       Point where the function gradient is to be evaluated
     epsilon: float
       Stepsize for finite differences
+    batch: bool
+      If True, `f` is assumed to take a (K, n) array of points as
+      input and return the K corresponding function values, and is
+      called only once.
 
     Returns
     -------
@@ -534,6 +1532,10 @@ def approx_gradient(f, x, epsilon):
       Function gradient at `x`
     """
     n = len(x)
+    if batch:
+        E = .5 * epsilon * np.eye(n)
+        fs = np.asarray(f(np.concatenate((x + E, x - E))))
+        return (fs[:n] - fs[n:]) / epsilon
     g = np.zeros(n)
     ei = np.zeros(n)
     for i in range(n):
@@ -543,7 +1545,38 @@ def approx_gradient(f, x, epsilon):
     return g
 
 
-def approx_hessian_diag(f, x, epsilon):
+def approx_jacobian(f, x, epsilon):
+    """
+    Approximate the Jacobian matrix of a vector-valued function using
+    central finite differences
+
+    Parameters
+    ----------
+    f: callable
+      The function to differentiate, returning a 1d array of the same
+      size as its input
+    x: ndarray
+      Point where the Jacobian is to be evaluated
+    epsilon: float
+      Stepsize for finite differences
+
+    Returns
+    -------
+    J: ndarray
+      Jacobian matrix at `x`, such that J[i, :] is the derivative of
+      f wrt x[i]
+    """
+    n = len(x)
+    J = np.zeros((n, n))
+    ei = np.zeros(n)
+    for i in range(n):
+        ei[i] = .5 * epsilon
+        J[i, :] = (f(x + ei) - f(x - ei)) / epsilon
+        ei[i] = 0
+    return J
+
+
+def approx_hessian_diag(f, x, epsilon, batch=False):
     """
     Approximate the Hessian diagonal of a function using central
     finite differences
@@ -556,6 +1589,8 @@ def approx_hessian_diag(f, x, epsilon):
       Point where the Hessian is to be evaluated
     epsilon: float
       Stepsize for finite differences
+    batch: bool
+      See `approx_gradient`
 
     Returns
     -------
@@ -563,6 +1598,10 @@ def approx_hessian_diag(f, x, epsilon):
       Diagonal of the Hessian at `x`
     """
     n = len(x)
+    if batch:
+        E = epsilon * np.eye(n)
+        fs = np.asarray(f(np.concatenate(([x], x + E, x - E))))
+        return (fs[1:n + 1] + fs[n + 1:] - 2 * fs[0]) / (epsilon ** 2)
     h = np.zeros(n)
     ei = np.zeros(n)
     fx = f(x)
@@ -573,7 +1612,7 @@ def approx_hessian_diag(f, x, epsilon):
     return h
 
 
-def approx_hessian(f, x, epsilon):
+def approx_hessian(f, x, epsilon, batch=False):
     """
     Approximate the full Hessian matrix of a function using central
     finite differences
@@ -586,6 +1625,8 @@ def approx_hessian(f, x, epsilon):
       Point where the Hessian is to be evaluated
     epsilon: float
       Stepsize for finite differences
+    batch: bool
+      See `approx_gradient`
 
     Returns
     -------
@@ -593,6 +1634,14 @@ def approx_hessian(f, x, epsilon):
       Hessian matrix at `x`
     """
     n = len(x)
+    if batch:
+        E = .5 * epsilon * np.eye(n)
+        pts = [x + s * E[:, None] + t * E[None] for s in (1, -1)
+               for t in (1, -1)]
+        fs = np.asarray(f(np.concatenate([p.reshape((-1, n))
+                                          for p in pts])))
+        fs = fs.reshape((4, n, n))
+        return (fs[0] - fs[1] - fs[2] + fs[3]) / (epsilon ** 2)
     H = np.zeros((n, n))
     ei = np.zeros(n)
     for i in range(n):
@@ -632,7 +1681,7 @@ def smooth(img, sigma):
 def _clamp_array(x, y, bins):
 
     # Threshold
-    dmaxmax = 2 ** (8 * y.dtype.itemsize - 1) - 1
+    dmaxmax = np.iinfo(y.dtype).max - (y.dtype.kind == 'u')
     dmax = bins - 1  # default output maximum value
     if dmax > dmaxmax:
         raise ValueError('Excess number of bins')
@@ -657,10 +1706,27 @@ def _clamp_array(x, y, bins):
     return y, bins
 
 
+def clamp_dtype(bins):
+    """
+    Narrowest type of `CLAMP_DTYPES` that can encode `bins` intensity
+    values besides the masked value (see `_mask_value`), e.g. unsigned
+    char for up to 255 bins.
+    """
+    for dtype in CLAMP_DTYPES:
+        dmax = np.iinfo(dtype).max - (np.dtype(dtype).kind == 'u')
+        if bins <= dmax + 1:
+            return np.dtype(dtype)
+    raise ValueError('Too large a bin size')
+
+
 def clamp_array(x, bins, mask=None):
     """
     Clamp array values that fall within a given mask in the range
-    [0..bins-1] and reset masked values to -1.
+    [0..bins-1] and reset masked values.
+
+    The output type is the narrowest one that can encode `bins`
+    values, see `clamp_dtype`. Masked values are -1 in signed short
+    arrays, and 255 in unsigned char arrays.
 
     Parameters
     ----------
@@ -674,13 +1740,13 @@ def clamp_array(x, bins, mask=None):
     Returns
     -------
     y : ndarray
-      Clamped array, masked items are assigned -1
+      Clamped array, masked items are assigned the masked value
     bins : int
       Adjusted number of bins
     """
-    if bins > np.iinfo(np.short).max:
-        raise ValueError('Too large a bin size')
-    y = -np.ones(x.shape, dtype=CLAMP_DTYPE)
+    dtype = clamp_dtype(bins)
+    y = np.empty(x.shape, dtype=dtype)
+    y.fill(_mask_value(dtype))
     if mask is None:
         y, bins = _clamp_array(x, y, bins)
     else:
@@ -693,7 +1759,8 @@ def clamp_array(x, bins, mask=None):
 
 def clamp(img, bins, mask=None, sigma=0):
     """Remap in-mask image intensity values to the range
-    [0..bins-1]. Out-of-mask voxels are mapped to -1. A spatial
+    [0..bins-1]. Out-of-mask voxels are mapped to the masked value of
+    the output type, see `clamp_array`. A spatial
     Gaussian filter is possibly applied as a pre-processing.
 
     Parameters
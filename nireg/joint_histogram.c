@@ -1,5 +1,5 @@
 #include "joint_histogram.h"
-#include "wichmann_prng.h"
+#include "philox_prng.h"
 
 #include <math.h>
 #include <stdlib.h>
@@ -7,264 +7,1171 @@
 
 
 #define SQR(a) ((a)*(a))
-#define FLOOR(a)((a)>0.0 ? (int)(a):(((int)(a)-a)!= 0.0 ? (int)(a)-1 : (int)(a)))  
 #define UROUND(a) ((int)(a+0.5))
-#define ROUND(a)(FLOOR(a+0.5))
 
 #ifdef _MSC_VER
 #define inline __inline
+#include <intrin.h>
 #endif
 
+/* 
+   Relaxed atomic increment of a uint32 count, used by threads
+   sharing a count histogram: counts need no ordering with respect to
+   other memory accesses as they are only read once all threads are
+   done.
+*/
+#if defined(__GNUC__) || defined(__clang__)
+#define ATOMIC_INCREMENT(p) __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#elif defined(_MSC_VER)
+#define ATOMIC_INCREMENT(p) _InterlockedIncrement((volatile long*)(p))
+#else
+#error "No atomic increment available for this compiler"
+#endif
+
+/* 
+   Instruction sets used to transform blocks of source samples in the
+   affine case, see _transform_block_method(). SSE2 is part of x86-64. With
+   GCC or clang on x86, AVX and AVX-512 versions are also compiled
+   using target attributes, and selected at run time if the CPU
+   supports them. Otherwise, they are only compiled if enabled at
+   compile time (e.g. -mavx512f, -mavx). A scalar version is always
+   compiled, and used on other architectures.
+*/
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CPU_DISPATCH
+#define HAVE_AVX
+#define HAVE_AVX512
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define HAVE_AVX
+#if defined(__AVX512F__)
+#define HAVE_AVX512
+#endif
+#endif
+
+/* Number of source samples transformed at once in the affine case */ 
+#define SAMPLE_BLOCK 8
+
+typedef void (*interpolation)(unsigned int, double*, unsigned int, 
+			      const int*, const double*, int, void*); 
+
+/* 
+   Random streams: source sample draws and random interpolation use
+   distinct streams of the generator, indexed by the draw number.
+*/
+#define SAMPLING_STREAM 0
+#define INTERPOLATION_STREAM 1
+
+/* Random interpolation parameters: generator and current draw number */ 
+typedef struct {
+  philox_state rng; 
+  npy_intp draw; 
+} random_state; 
+
+/* 
+   Layout of the padded target image: grid point (x, y, z) is stored
+   at offset x[x] + y[y] + z[z] in the image array. 
+*/ 
+typedef struct {
+  const npy_intp* x; 
+  const npy_intp* y; 
+  const npy_intp* z; 
+} target_layout; 
+
+/* 
+   Occupancy map of the padded target image: the cell of grid point
+   (x, y, z) is flagged by data[(x>>OCCUPANCY_SHIFT)*sx +
+   (y>>OCCUPANCY_SHIFT)*sy + (z>>OCCUPANCY_SHIFT)], or all cells are
+   assumed occupied if data is NULL. 
+*/ 
+typedef struct {
+  const unsigned char* data; 
+  npy_intp sx; 
+  npy_intp sy; 
+} target_occupancy; 
+
+#if OCCUPANCY_CELL == 8
+#define OCCUPANCY_SHIFT 3
+#else
+#error "OCCUPANCY_CELL should be 8"
+#endif
+
+/* Whether samples with floor neighbor (x, y, z) may have unmasked
+   neighbors */ 
+#define OCCUPIED(O, x, y, z)						\
+  ((!(O)->data) ||							\
+   (O)->data[((x)>>OCCUPANCY_SHIFT)*(O)->sx +				\
+	     ((y)>>OCCUPANCY_SHIFT)*(O)->sy + ((z)>>OCCUPANCY_SHIFT)])
+
 static inline void _pv_interpolation(unsigned int i, 
 				     double* H, unsigned int clampJ, 
-				     const signed short* J, 
+				     const int* J, 
 				     const double* W, 
 				     int nn, 
 				     void* params);
 static inline void _tri_interpolation(unsigned int i, 
 				      double* H, unsigned int clampJ, 
-				      const signed short* J, 
+				      const int* J, 
 				      const double* W, 
 				      int nn, 
 				      void* params);
 static inline void _rand_interpolation(unsigned int i, 
 				       double* H, unsigned int clampJ, 
-				       const signed short* J, 
+				       const int* J, 
 				       const double* W, 
 				       int nn, 
 				       void* params); 
+static inline void _pv_moments(unsigned int i, 
+			       double* H, unsigned int clampJ, 
+			       const int* J, 
+			       const double* W, 
+			       int nn, 
+			       void* params);
+static inline void _tri_moments(unsigned int i, 
+				double* H, unsigned int clampJ, 
+				const int* J, 
+				const double* W, 
+				int nn, 
+				void* params);
+static inline void _rand_moments(unsigned int i, 
+				 double* H, unsigned int clampJ, 
+				 const int* J, 
+				 const double* W, 
+				 int nn, 
+				 void* params);
+static inline void _parzen_interpolation(unsigned int i, 
+					 double* H, unsigned int clampJ, 
+					 const int* J, 
+					 const double* W, 
+					 int nn, 
+					 void* params);
+static inline void _parzen_moments(unsigned int i, 
+				   double* H, unsigned int clampJ, 
+				   const int* J, 
+				   const double* W, 
+				   int nn, 
+				   void* params);
+static inline void _pv_hashed(unsigned int i, 
+			      double* H, unsigned int clampJ, 
+			      const int* J, 
+			      const double* W, 
+			      int nn, 
+			      void* params);
+static inline void _tri_hashed(unsigned int i, 
+			       double* H, unsigned int clampJ, 
+			       const int* J, 
+			       const double* W, 
+			       int nn, 
+			       void* params);
+static inline void _rand_hashed(unsigned int i, 
+				double* H, unsigned int clampJ, 
+				const int* J, 
+				const double* W, 
+				int nn, 
+				void* params);
+static inline void _rand_counts(unsigned int i, 
+				double* H, unsigned int clampJ, 
+				const int* J, 
+				const double* W, 
+				int nn, 
+				void* params);
+
+
+/* 
+   _transform_block functions, one per instruction set (see
+   transform_block_impl.h): transform the grid coordinates (x, y, z)
+   of a block of SAMPLE_BLOCK source samples by the 3x4 affine matrix
+   t. For each transformed
+   point falling within the target grid of size dims, compute its
+   floor neighbor (nx, ny, nz) in the padded target image and the
+   trilinear weights (wx, wy, wz) of that neighbor along each axis, as
+   in _update_histogram(). Returns a bit mask of the points within
+   the grid. 
+
+   Coordinates are transformed with the same operation order as in
+   the scalar code, so that results do not depend on the instruction
+   set unless the compiler contracts the scalar code into fused
+   multiply-adds. The kernels call the version selected by
+   joint_histogram_simd() through _transform_block_method().
+*/ 
+#ifdef CPU_DISPATCH
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
+#define TRANSFORM_BLOCK _transform_block_scalar
+#define TARGET_ATTRIBUTE
+#include "transform_block_impl.h"
+
+#ifdef HAVE_SSE2
+#define TRANSFORM_BLOCK _transform_block_sse2
+#define TARGET_ATTRIBUTE
+#define LANES 2
+#define VECTOR __m128d
+#define VECTORI __m128i
+#define MASK __m128d
+#define LOADI(p) _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)(p)))
+#define SET1 _mm_set1_pd
+#define ADD _mm_add_pd
+#define SUB _mm_sub_pd
+#define MUL _mm_mul_pd
+#define AND _mm_and_pd
+#define GT _mm_cmpgt_pd
+#define LT _mm_cmplt_pd
+#define CVTT _mm_cvttpd_epi32
+#define CVTI _mm_cvtepi32_pd
+#define STORE _mm_storeu_pd
+#define STOREI(p, a) _mm_storel_epi64((__m128i*)(p), a)
+#define MOVEMASK(a) ((unsigned int)_mm_movemask_pd(a))
+#include "transform_block_impl.h"
+#endif
+
+#ifdef HAVE_AVX
+#define TRANSFORM_BLOCK _transform_block_avx
+#define TARGET_ATTRIBUTE TARGET("avx")
+#define LANES 4
+#define VECTOR __m256d
+#define VECTORI __m128i
+#define MASK __m256d
+#define LOADI(p) _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(p)))
+#define SET1 _mm256_set1_pd
+#define ADD _mm256_add_pd
+#define SUB _mm256_sub_pd
+#define MUL _mm256_mul_pd
+#define AND _mm256_and_pd
+#define GT(a, b) _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define LT(a, b) _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define CVTT _mm256_cvttpd_epi32
+#define CVTI _mm256_cvtepi32_pd
+#define STORE _mm256_storeu_pd
+#define STOREI(p, a) _mm_storeu_si128((__m128i*)(p), a)
+#define MOVEMASK(a) ((unsigned int)_mm256_movemask_pd(a))
+#include "transform_block_impl.h"
+#endif
+
+#ifdef HAVE_AVX512
+#define TRANSFORM_BLOCK _transform_block_avx512
+#define TARGET_ATTRIBUTE TARGET("avx512f")
+#define LANES 8
+#define VECTOR __m512d
+#define VECTORI __m256i
+#define MASK __mmask8
+#define LOADI(p) _mm512_cvtepi32_pd(_mm256_loadu_si256((const __m256i*)(p)))
+#define SET1 _mm512_set1_pd
+#define ADD _mm512_add_pd
+#define SUB _mm512_sub_pd
+#define MUL _mm512_mul_pd
+#define AND(a, b) ((a) & (b))
+#define GT(a, b) _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ)
+#define LT(a, b) _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ)
+#define CVTT _mm512_cvttpd_epi32
+#define CVTI _mm512_cvtepi32_pd
+#define STORE _mm512_storeu_pd
+#define STOREI(p, a) _mm256_storeu_si256((__m256i*)(p), a)
+#define MOVEMASK(a) ((unsigned int)(a))
+#include "transform_block_impl.h"
+#endif
+
+#undef TARGET
+
+/* Check whether the build and the CPU support an instruction set */ 
+static int _simd_supported(int level)
+{
+  switch (level) {
+  case SIMD_SCALAR: 
+    return 1; 
+#ifdef HAVE_SSE2
+  case SIMD_SSE2: 
+    return 1; 
+#endif
+#ifdef HAVE_AVX
+  case SIMD_AVX: 
+#ifdef CPU_DISPATCH
+    __builtin_cpu_init(); 
+    return __builtin_cpu_supports("avx"); 
+#else
+    return 1; 
+#endif
+#endif
+#ifdef HAVE_AVX512
+  case SIMD_AVX512: 
+#ifdef CPU_DISPATCH
+    __builtin_cpu_init(); 
+    return __builtin_cpu_supports("avx512f"); 
+#else
+    return 1; 
+#endif
+#endif
+  }
+  return 0; 
+}
+
+/* Selected instruction set, see joint_histogram_simd() */ 
+static int _simd = -1; 
+
+int joint_histogram_simd(int level)
+{
+  if (_simd < 0) 
+    for (_simd=SIMD_AVX512; !_simd_supported(_simd); _simd--); 
+  if (level >= 0) {
+    if (level > SIMD_AVX512) 
+      level = SIMD_AVX512; 
+    for (; !_simd_supported(level); level--); 
+    _simd = level; 
+  }
+  return _simd; 
+}
+
+typedef unsigned int (*transform_block)(int*, int*, int*, 
+					double*, double*, double*, 
+					const int*, const int*, const int*, 
+					const double*, const double*); 
+
+/* _transform_block function for the selected instruction set */ 
+static transform_block _transform_block_method(void)
+{
+  switch (joint_histogram_simd(-1)) {
+#ifdef HAVE_AVX512
+  case SIMD_AVX512: 
+    return &_transform_block_avx512; 
+#endif
+#ifdef HAVE_AVX
+  case SIMD_AVX: 
+    return &_transform_block_avx; 
+#endif
+#ifdef HAVE_SSE2
+  case SIMD_SSE2: 
+    return &_transform_block_sse2; 
+#endif
+  }
+  return &_transform_block_scalar; 
+}
+
+
+/* 
+   FIXED-POINT COORDINATES. 
+
+   Transformations and transformed coordinates may be given as 16.16
+   fixed-point int arrays, i.e. scaled by 2^16 and rounded. Affine
+   transformations are then applied in integer arithmetic, stepping
+   by integer adds along runs of samples with consecutive z
+   coordinates, which gives the same result as the direct
+   computation. Transformed coordinates are rounded to WEIGHT_BITS
+   fractional bits, and per-axis trilinear weights read from a lookup
+   table. 
+
+   Compared to double precision, each transformed coordinate is off
+   by at most 2^-17 (|x|+|y|+|z|+1) voxels due to the rounding of the
+   transformation, plus 2^-9 voxels due to the weight resolution,
+   i.e. less than 0.01 voxels for grids of size up to 512. Since
+   each per-axis weight is a 1-Lipschitz function of the coordinate,
+   this bounds the deviation of each interpolation weight, and the
+   L1 distance between partial volume histograms is at most 3 times
+   that bound per sample, up to samples crossing the grid boundary.
+*/ 
+#define FIXED_SHIFT 16
+#define FIXED_ONE ((npy_int64)1 << FIXED_SHIFT)
+#define WEIGHT_BITS 8
+#define WEIGHT_SHIFT (FIXED_SHIFT-WEIGHT_BITS)
+
+/* Floor side weights 1 - f/256 for each 8-bit fraction f */ 
+#define WEIGHT1(f) (1.0 - (f)/256.0)
+#define WEIGHT4(f) WEIGHT1(f), WEIGHT1(f+1), WEIGHT1(f+2), WEIGHT1(f+3)
+#define WEIGHT16(f) WEIGHT4(f), WEIGHT4(f+4), WEIGHT4(f+8), WEIGHT4(f+12)
+#define WEIGHT64(f) WEIGHT16(f), WEIGHT16(f+16), WEIGHT16(f+32), WEIGHT16(f+48)
+static const double _fixed_weights[1 << WEIGHT_BITS] = {
+  WEIGHT64(0), WEIGHT64(64), WEIGHT64(128), WEIGHT64(192)
+}; 
+#undef WEIGHT1
+#undef WEIGHT4
+#undef WEIGHT16
+#undef WEIGHT64
+
+/* 
+   Floor neighbor n in the padded target image and floor side weight
+   w of a fixed-point coordinate T along an axis of the target grid,
+   where lim is the axis size plus one in fixed-point. Returns 0 if T
+   is outside the grid, 1 otherwise. 
+*/ 
+static inline int _fixed_neighbor(int* n, 
+				  double* w, 
+				  npy_int64 T, 
+				  npy_int64 lim)
+{
+  /* Padded coordinate rounded to the weight resolution */ 
+  npy_int64 u = T + FIXED_ONE + ((npy_int64)1 << (WEIGHT_SHIFT-1)); 
+
+  if ((u <= 0) || (u >= lim)) 
+    return 0; 
+  *n = (int)(u >> FIXED_SHIFT); 
+  *w = _fixed_weights[(u >> WEIGHT_SHIFT) & ((1 << WEIGHT_BITS)-1)]; 
+  return 1; 
+}
+
+/* Fixed-point version of the _transform_block functions, where lims are the target
+   grid dimensions plus one in fixed-point. */ 
+static inline unsigned int _transform_block_fixed(int* nx, 
+						  int* ny, 
+						  int* nz, 
+						  double* wx, 
+						  double* wy, 
+						  double* wz, 
+						  const int* x, 
+						  const int* y, 
+						  const int* z, 
+						  const int* t, 
+						  const npy_int64* lims)
+{
+  unsigned int inside = 0; 
+  npy_int64 Tx = 0, Ty = 0, Tz = 0; 
+  int k; 
+
+  for (k=0; k<SAMPLE_BLOCK; k++) {
+    if ((k>0) && (x[k]==x[k-1]) && (y[k]==y[k-1]) && (z[k]==z[k-1]+1)) {
+      Tx += t[2]; 
+      Ty += t[6]; 
+      Tz += t[10]; 
+    }
+    else {
+      Tx = (npy_int64)t[0]*x[k] + (npy_int64)t[1]*y[k] + (npy_int64)t[2]*z[k] + t[3]; 
+      Ty = (npy_int64)t[4]*x[k] + (npy_int64)t[5]*y[k] + (npy_int64)t[6]*z[k] + t[7]; 
+      Tz = (npy_int64)t[8]*x[k] + (npy_int64)t[9]*y[k] + (npy_int64)t[10]*z[k] + t[11]; 
+    }
+    if (_fixed_neighbor(nx+k, wx+k, Tx, lims[0]) && 
+	_fixed_neighbor(ny+k, wy+k, Ty, lims[1]) && 
+	_fixed_neighbor(nz+k, wz+k, Tz, lims[2])) 
+      inside |= 1u << k; 
+  }
+
+  return inside; 
+}
+
+
+/* 
+   Check the transformation array: either double, or int for
+   fixed-point coordinates if allowed. Returns 1 in the latter case,
+   0 in the former, and -1 if the type is not supported. 
+*/ 
+static int _check_transform(const PyArrayObject* Tvox, int allow_fixed)
+{
+  if (PyArray_TYPE(Tvox) == NPY_DOUBLE) 
+    return 0; 
+  if (allow_fixed && (PyArray_TYPE(Tvox) == NPY_INT)) 
+    return 1; 
+  fprintf(stderr, allow_fixed ? 
+	  "Transformation should be double or fixed-point int\n" : 
+	  "Transformation should be double\n"); 
+  return -1; 
+}
+
+/* 
+   Check the packed source sample arrays: samples should be a contiguous
+   array of N intensities and, if required, XYZ a
+   C-contiguous int array of shape (3, N) holding the corresponding
+   grid coordinates. 
+*/
+static int _check_samples(const PyArrayObject* samples, 
+			  const PyArrayObject* XYZ, 
+			  int need_coords)
+{
+  if (!PyArray_ISCONTIGUOUS(samples)) {
+    fprintf(stderr, "Source intensities should be contiguous\n");
+    return -1; 
+  }
+  if (!need_coords)
+    return 0; 
+  if ((PyArray_TYPE(XYZ) != NPY_INT) || (!PyArray_ISCONTIGUOUS(XYZ)) ||
+      (PyArray_NDIM(XYZ) != 2) || (PyArray_DIM(XYZ, 0) != 3) ||
+      (PyArray_DIM(XYZ, 1) != PyArray_SIZE(samples))) {
+    fprintf(stderr, "Source coordinates should be a contiguous 3xN int array\n");
+    return -1; 
+  }
+  return 0; 
+}
+
+
+/* 
+   Set the padded target image layout from a C-contiguous npy_intp
+   array of shape (3, L) holding the offsets of grid points along each
+   axis, where L is at least the largest dimension of imJ_padded. 
+*/
+static int _init_layout(target_layout* L, 
+			const PyArrayObject* layout, 
+			const PyArrayObject* imJ_padded)
+{
+  npy_intp size; 
+  
+  if ((PyArray_TYPE(layout) != NPY_INTP) || 
+      (!PyArray_ISCONTIGUOUS(layout)) || 
+      (PyArray_NDIM(layout) != 2) || 
+      (PyArray_DIM(layout, 0) != 3)) {
+    fprintf(stderr, "Target layout should be a C-contiguous intp array of shape (3, L)\n");
+    return -1; 
+  }
+  size = PyArray_DIM(layout, 1); 
+  if ((PyArray_DIM(imJ_padded, 0) > size) || 
+      (PyArray_DIM(imJ_padded, 1) > size) || 
+      (PyArray_DIM(imJ_padded, 2) > size)) {
+    fprintf(stderr, "Target layout is too small\n");
+    return -1; 
+  }
+  L->x = (const npy_intp*)PyArray_DATA(layout); 
+  L->y = L->x + size; 
+  L->z = L->y + size; 
+
+  return 0; 
+}
+
+
+/* 
+   Set the occupancy map of the padded target image from an unsigned
+   char C-contiguous array with one entry per cell of OCCUPANCY_CELL^3
+   grid points (rounding up), or disable it if the array is empty. 
+*/
+static int _init_occupancy(target_occupancy* O, 
+			   const PyArrayObject* occupancy, 
+			   const PyArrayObject* imJ_padded)
+{
+  int i; 
+
+  O->data = NULL; 
+  if (PyArray_SIZE(occupancy) == 0) 
+    return 0; 
+  if ((PyArray_TYPE(occupancy) != NPY_UBYTE) || 
+      (!PyArray_ISCONTIGUOUS(occupancy)) || 
+      (PyArray_NDIM(occupancy) != 3)) {
+    fprintf(stderr, "Target occupancy should be a C-contiguous three-dimensional unsigned char array\n");
+    return -1; 
+  }
+  for (i=0; i<3; i++) 
+    if (PyArray_DIM(occupancy, i) != 
+	(PyArray_DIM(imJ_padded, i) + OCCUPANCY_CELL - 1) / OCCUPANCY_CELL) {
+      fprintf(stderr, "Target occupancy has wrong shape\n");
+      return -1; 
+    }
+  O->data = (const unsigned char*)PyArray_DATA(occupancy); 
+  O->sy = PyArray_DIM(occupancy, 2); 
+  O->sx = PyArray_DIM(occupancy, 1) * O->sy; 
+
+  return 0; 
+}
+
+
+/* 
+   PARZEN WINDOWS. The continuous target intensity jm of a sample is
+   spread over the bins j0-1, ..., j0+2, where j0 = floor(jm), with
+   cubic B-spline weights w[k] = B(j0+k-1-jm), which sum up to one
+   and have mean jm and variance 1/3. Bins beyond the histogram range
+   are folded onto the edge bins. If dw is not NULL, it is filled
+   with the derivatives of the weights with respect to jm.
+*/
+#define PARZEN_VARIANCE (1.0/3.0)
+#define PARZEN_BIN(b, clampJ)					\
+  ((b) < 0 ? 0 : ((b) >= (int)(clampJ) ? (int)(clampJ)-1 : (b)))
+
+static inline int _parzen_window(double* w, double* dw, double jm)
+{
+  int j0 = (int)jm; 
+  double f = jm - j0, g = 1 - f, f2 = f*f; 
+
+  w[0] = g*g*g/6; 
+  w[1] = 2.0/3.0 - f2 + .5*f2*f; 
+  w[2] = 2.0/3.0 - g*g + .5*g*g*g; 
+  w[3] = f2*f/6; 
+  if (dw) {
+    dw[0] = -.5*g*g; 
+    dw[1] = 1.5*f2 - 2*f; 
+    dw[2] = -1.5*f2 + f + .5; 
+    dw[3] = .5*f2; 
+  }
+  return j0; 
+}
+
+
+/* 
+   HASHED HISTOGRAMS (see joint_histogram.h). Entries are found by
+   linear probing from a multiplicative hash of their key. New entries
+   are only inserted while the table is less than half full, which
+   keeps probe sequences short; contributions to entries that could
+   not be inserted are counted as dropped. Keys are below 2^30, hence
+   exactly represented as doubles.
+*/
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+static int _check_hashed(const PyArrayObject* T)
+{
+  npy_intp C; 
+
+  if ((PyArray_TYPE(T) != NPY_DOUBLE) || 
+      (!PyArray_ISCONTIGUOUS(T)) || 
+      (PyArray_NDIM(T) != 2) || 
+      (PyArray_DIM(T, 1) != 2)) {
+    fprintf(stderr, "Hashed histogram should be a double C-contiguous array of shape (C+1, 2)\n");
+    return -1; 
+  }
+  C = PyArray_DIM(T, 0) - 1; 
+  if ((C < 1) || (C & (C-1)) || ((npy_uint64)C > 0xFFFFFFFFULL)) {
+    fprintf(stderr, "Hashed histogram capacity should be a power of two\n");
+    return -1; 
+  }
+  return 0; 
+}
+
+/* Check that H is a count histogram, see HISTOGRAM_COUNTS */ 
+static int _check_counts(const PyArrayObject* H)
+{
+  if ((PyArray_TYPE(H) != NPY_UINT32) || (!PyArray_ISCONTIGUOUS(H))) {
+    fprintf(stderr, "Count histogram should be a uint32 C-contiguous array\n");
+    return -1; 
+  }
+  return 0; 
+}
+
+/* Add w to the entry of given key in the hashed histogram T of
+   capacity mask+1 */ 
+static inline void _hashed_add(double* T, 
+			       npy_intp mask, 
+			       npy_intp key, 
+			       double w)
+{
+  double *count = T + 2*(mask+1); 
+  double k = (double)key; 
+  npy_intp s = (npy_intp)((((npy_uint64)key*HASH_MULTIPLIER) >> 32) & mask); 
+
+  while (T[2*s] != k) {
+    if (T[2*s] == 0) {
+      if (2*count[0] >= mask+1) {
+	count[1] += 1; 
+	return; 
+      }
+      T[2*s] = k; 
+      count[0] += 1; 
+      break; 
+    }
+    s = (s+1) & mask; 
+  }
+  T[2*s+1] += w; 
+
+  return; 
+}
+
+
+/* 
+   ROW CLIPPING. 
+
+   When all source samples are drawn, the affine case processes the
+   sample list row by row, where a row is a run of samples sharing
+   their x and y coordinates, hence with increasing z coordinates
+   both in C order and in tile order. Along a row, the transformed
+   coordinates are affine functions of z, so that the samples
+   falling within the target grid have z within an interval computed
+   in closed form. Samples outside of that interval are skipped
+   without being gathered or transformed, which saves most of the
+   work in partial coverage registrations. 
+
+   The interval is widened by CLIP_MARGIN voxels so that rounding
+   errors, including those of fixed-point coordinates, never exclude
+   a sample that the per-sample test of the _transform_block
+   functions would accept: histograms are unchanged by clipping.
+*/
+#define CLIP_MARGIN 1e-2
+
+/* End of the row of samples starting at index k, see above */ 
+static inline npy_intp _row_end(const int* X, 
+				const int* Y, 
+				npy_intp k, 
+				npy_intp stop)
+{
+  int x = X[k], y = Y[k]; 
+
+  for (k++; (k<stop) && (X[k]==x) && (Y[k]==y); k++); 
+  return k; 
+}
+
+/* First index in [k, stop) such that Z is greater than z, or stop */ 
+static inline npy_intp _z_search(const int* Z, 
+				 npy_intp k, 
+				 npy_intp stop, 
+				 double z)
+{
+  npy_intp m; 
+
+  while (k < stop) {
+    m = k + (stop-k)/2; 
+    if (Z[m] > z) 
+      stop = m; 
+    else 
+      k = m + 1; 
+  }
+  return k; 
+}
+
+/* 
+   Clip the row of samples [k, stop) with grid coordinates x, y and
+   Z[k:stop] to the range [*r0, *r1) of those whose transform by the
+   3x4 affine matrix t may fall within the target grid of size
+   dims. 
+*/ 
+static inline void _clip_row(npy_intp* r0, 
+			     npy_intp* r1, 
+			     const int* Z, 
+			     npy_intp k, 
+			     npy_intp stop, 
+			     int x, 
+			     int y, 
+			     const double* t, 
+			     const double* dims)
+{
+  double zmin = -HUGE_VAL, zmax = HUGE_VAL, p, q, a, b; 
+  int i; 
+
+  for (i=0; i<3; i++, t+=4) {
+    /* Transformed coordinate p + q z should be in (-1, dims[i]) */ 
+    p = t[0]*x + t[1]*y + t[3]; 
+    q = t[2]; 
+    if (q == 0) {
+      if ((p <= -1-CLIP_MARGIN) || (p >= dims[i]+CLIP_MARGIN)) {
+	*r0 = *r1 = stop; 
+	return; 
+      }
+      continue; 
+    }
+    a = (-1-CLIP_MARGIN-p)/q; 
+    b = (dims[i]+CLIP_MARGIN-p)/q; 
+    if (q < 0) {
+      q = a; a = b; b = q; 
+    }
+    if (a > zmin) 
+      zmin = a; 
+    if (b < zmax) 
+      zmax = b; 
+  }
+  *r0 = _z_search(Z, k, stop, zmin); 
+  *r1 = (zmax > zmin) ? _z_search(Z, *r0, stop, zmax) : *r0; 
+}
+
+
+/* 
+   Number of draws corresponding to a sampling scheme, see
+   above. Also seeds the generator and sets the stratum size used by
+   _draw_sample(). 
+*/
+static npy_intp _init_sampling(int sampling, 
+			       npy_intp N, 
+			       npy_intp nsamples, 
+			       long seed, 
+			       double* stratum, 
+			       philox_state* rng) 
+{
+  if ((sampling == 0) || (N == 0)) 
+    return (sampling == 0) ? N : 0; 
+  if (nsamples < 0) 
+    nsamples = 0; 
+  *stratum = (double)N / (double)nsamples; 
+  philox_seed(seed, SAMPLING_STREAM, rng); 
+  return nsamples; 
+}
+
+/* Index in the source sample list of the k-th draw */ 
+static inline npy_intp _draw_sample(npy_intp k, 
+				    int sampling, 
+				    npy_intp N, 
+				    double stratum, 
+				    const philox_state* rng) 
+{
+  npy_intp n; 
+  if (sampling == 0) 
+    return k; 
+  else if (sampling == 1) 
+    n = (npy_intp)(N*philox_double(rng, k)); 
+  else 
+    n = (npy_intp)((k+philox_double(rng, k))*stratum); 
+  return (n < N) ? n : N-1; 
+}
+
+/* 
+   Interpolation method corresponding to interp, accumulating either
+   dense joint histogram entries, target intensity moments, hashed
+   histogram entries or draw counts depending on mode. Both are
+   assumed valid, see _check_mode. In random mode, the generator in rand is seeded and rand is returned
+   in params; its draw number is then to be set before each call. 
+*/ 
+static interpolation _interpolation_method(long interp, 
+					   int mode, 
+					   random_state* rand, 
+					   void** params) 
+{
+  static const interpolation methods[4][4] = {
+    {&_pv_interpolation, &_tri_interpolation, &_rand_interpolation, 
+     &_parzen_interpolation}, 
+    {&_pv_moments, &_tri_moments, &_rand_moments, &_parzen_moments}, 
+    {&_pv_hashed, &_tri_hashed, &_rand_hashed, NULL}, 
+    {NULL, NULL, &_rand_counts, NULL}}; 
+
+  *params = NULL; 
+  if (interp==0) 
+    return methods[mode][0];
+  else if (interp==1) 
+    return methods[mode][1]; 
+  else if (interp==PARZEN_INTERPOLATION) 
+    return methods[mode][3]; 
+  /* interp < 0 */ 
+  philox_seed(-interp, INTERPOLATION_STREAM, &rand->rng); 
+  rand->draw = 0; 
+  *params = (void*)rand; 
+  return methods[mode][2];
+}
+
+/* Check the accumulation mode, interp and their compatibility */ 
+static int _check_mode(int mode, long interp) 
+{
+  if ((mode < HISTOGRAM_DENSE) || (mode > HISTOGRAM_COUNTS)) {
+    fprintf(stderr, "Unknown histogram accumulation mode\n");
+    return -1; 
+  }
+  if (interp > PARZEN_INTERPOLATION) {
+    fprintf(stderr, "Unknown interpolation method\n");
+    return -1; 
+  }
+  if ((mode == HISTOGRAM_COUNTS) && (interp >= 0)) {
+    fprintf(stderr, "Count histograms require random interpolation\n");
+    return -1; 
+  }
+  if ((mode == HISTOGRAM_HASHED) && (interp == PARZEN_INTERPOLATION)) {
+    fprintf(stderr, "Parzen windows require dense histograms or moments\n");
+    return -1; 
+  }
+  return 0; 
+}
+
+
+/* 
+   Clamped intensity types: masked voxels are encoded as negative
+   values in signed short images and as 255 in unsigned char images,
+   which is converted to -1 on load. 
+*/ 
+#define LOAD_SHORT(p, n) ((int)(p)[n])
+#define LOAD_UBYTE(p, n) ((int)(p)[n] - (((p)[n] == 0xff) << 8))
+
+/* Kernel specializations for each pair of source and target types */ 
+#define CONCAT_(a, b) a ## _ ## b
+#define CONCAT(a, b) CONCAT_(a, b)
+#define SPECIALIZE(name) CONCAT(name, TYPES)
+
+#define SOURCE_TYPE signed short
+#define LOAD_SOURCE LOAD_SHORT
+#define TARGET_TYPE signed short
+#define LOAD_TARGET LOAD_SHORT
+#define TYPES short_short
+#include "joint_histogram_impl.h"
+
+#define SOURCE_TYPE signed short
+#define LOAD_SOURCE LOAD_SHORT
+#define TARGET_TYPE unsigned char
+#define LOAD_TARGET LOAD_UBYTE
+#define TYPES short_ubyte
+#include "joint_histogram_impl.h"
+
+#define SOURCE_TYPE unsigned char
+#define LOAD_SOURCE LOAD_UBYTE
+#define TARGET_TYPE signed short
+#define LOAD_TARGET LOAD_SHORT
+#define TYPES ubyte_short
+#include "joint_histogram_impl.h"
+
+#define SOURCE_TYPE unsigned char
+#define LOAD_SOURCE LOAD_UBYTE
+#define TARGET_TYPE unsigned char
+#define LOAD_TARGET LOAD_UBYTE
+#define TYPES ubyte_ubyte
+#include "joint_histogram_impl.h"
+
+#undef SPECIALIZE
+
+/* 
+   Specialization index for the intensity types of the source samples
+   and the target image imJ_padded, or -1 if not supported. 
+*/ 
+static int _specialization(const PyArrayObject* samples, 
+			   const PyArrayObject* imJ_padded)
+{
+  int ti = PyArray_TYPE(samples), tj = PyArray_TYPE(imJ_padded); 
+
+  if (((ti != NPY_SHORT) && (ti != NPY_UBYTE)) || 
+      ((tj != NPY_SHORT) && (tj != NPY_UBYTE))) {
+    fprintf(stderr, "Intensities should be signed short or unsigned char\n");
+    return -1; 
+  }
+  return 2*(ti == NPY_UBYTE) + (tj == NPY_UBYTE); 
+}
+
+#define DISPATCH(name, args)			\
+  switch (_specialization(samples, imJ_padded)) {	\
+  case 0: return name ## _short_short args;	\
+  case 1: return name ## _short_ubyte args;	\
+  case 2: return name ## _ubyte_short args;	\
+  case 3: return name ## _ubyte_ubyte args;	\
+  }						\
+  return -1
+
 
 /* 
    
 JOINT HISTOGRAM COMPUTATION. 
   
-iterI : assumed to iterate over a signed short encoded, possibly
-non-contiguous array.
+samples : packed source samples, assumed to be a contiguous array of N
+intensities, either signed short or unsigned char. Masked voxels are
+expected to be left out, although masked values (negative for signed
+short, 255 for unsigned char) are still ignored.
+
+XYZ : grid coordinates of the source samples, assumed to be a
+C-contiguous int array of shape (3, N), i.e. stored as three
+consecutive arrays of x, y and z coordinates. Only used for affine
+transformations.
+
+imJ_padded : assumed contiguous and either signed short or unsigned
+char encoded, with masked values as in samples. Its shape is that of the
+target grid padded with at least one voxel on each side. Each pair of
+source and target types has its own compiled kernel.
 
-imJ_padded : assumed C-contiguous (last index varies faster) & signed
-short encoded.
+layout : C-contiguous npy_intp array of shape (3, L) such that the
+padded target grid point (x, y, z) is stored in imJ_padded at offset
+layout[0, x] + layout[1, y] + layout[2, z]. For a plain C-order
+image, these are x*u4, y*u2 and z where u2 and u4 are the strides of
+imJ_padded along y and x. Other layouts, e.g. with the image stored
+as a sequence of cubic bricks, keep the 8 neighbors of transformed
+points within fewer cache lines and pages. Extra padding voxels must
+be negative so that they are ignored.
+
+occupancy : either empty, or a C-contiguous unsigned char array of
+shape ceil(imJ_padded.shape / OCCUPANCY_CELL), whose entry for the
+cell of grid point n is zero only if the 8 grid points n + {0, 1}^3
+are masked for every n in the cell. Samples whose floor neighbor
+falls in such a cell are then rejected with a single lookup, which
+saves most of the interpolation work for targets with large masked
+regions, e.g. skull-stripped images. Histograms are unchanged.
 
 H : assumed C-contiguous. 
 
 Tvox : assumed C-contiguous: 
 
-  either a 3x4=12-sized array (or bigger) for an affine transformation
+  either a 3x4 (or 4x4) array for an affine voxel-to-voxel
+  transformation, in which case the transformed coordinates are
+  computed on the fly from the source grid coordinates XYZ
 
-  or a 3xN array for a pre-computed transformation, with N equal to
-  the size of the array corresponding to iterI (no checking done)
+  or a Nx3 array for a pre-computed transformation of the source
+  samples
 
-Negative intensities are ignored.  
+  The two cases are distinguished by the size of the last dimension
+  of Tvox: 4 for an affine transformation, 3 otherwise. Tvox is
+  either double, or int for 16.16 fixed-point values (see
+  FIXED-POINT COORDINATES above), which trades a bounded deviation
+  of the interpolation weights for integer coordinate arithmetic and
+  half the coordinate bandwidth. 
 
-*/
+mode : HISTOGRAM_DENSE to compute the joint histogram h, or either
+of the following:
+
+  HISTOGRAM_MOMENTS - H is replaced with the sufficient statistics
+  of the target intensity j given each source intensity i, namely
+  M[i] = (n(i), sum_j j h(i,j), sum_j j^2 h(i,j)). M is assumed
+  C-contiguous with shape (clampI, 3), and clampJ is ignored. This is
+  all the correlation coefficient and correlation ratio need, and
+  avoids the clampI x clampJ histogram altogether.
+
+  HISTOGRAM_HASHED - H is replaced with a hashed histogram of the
+  non-empty entries of h (see HASHED HISTOGRAMS above), and clampI
+  and clampJ are ignored. Memory and initialization time then scale
+  with the number of non-empty entries, which for large bin counts is
+  much lower than clampI x clampJ. Zero partial volume weights are
+  not accounted for. If the table gets half full, further new entries
+  are dropped and counted in its last row.
+
+  HISTOGRAM_COUNTS - H is a uint32 C-contiguous (clampI, clampJ)
+  array to which the draws of random interpolation, the only
+  interpolation supported, are added as integer counts. Each count
+  is incremented atomically and H is not re-initialized, so several
+  threads may process distinct ranges of draws into the same
+  histogram instead of filling private copies that are summed
+  afterwards. Since integer additions commute, the result does not
+  depend on thread scheduling. This halves the histogram size
+  relative to doubles and removes the final reduction, which matters
+  for large bin counts.
+
+sampling : source sampling scheme, where nsamples (M) and seed are
+only used for stochastic sampling:
+  0 - all the N source samples are used
+  1 - RANDOM sampling: M samples drawn uniformly with replacement
+  2 - STRATIFIED sampling: the sample list is split into M strata
+      of equal size, and one sample is drawn uniformly in each
+      stratum. Since samples are stored in C order or tile order,
+      this amounts to a spatially stratified subset of the source
+      voxels.
+The subset is drawn on the fly using a counter-based generator
+seeded with seed, so that no index array is built.
 
-#define APPEND_NEIGHBOR(q, w)			\
-  j = J[q];					\
-  if (j>=0) {					\
-    *bufJnn = j; bufJnn ++; 			\
-    *bufW = w; bufW ++;				\
-    nn ++; }
+interp : 0 for partial volume, 1 for trilinear, PARZEN_INTERPOLATION
+(2) for Parzen windows (see PARZEN WINDOWS above), <0 for random
+interpolation using a counter-based generator seeded with -interp.
+Other positive values are rejected. Parzen windows spread the mass
+of each sample over neighboring target bins, so that the histogram,
+and similarity measures computed from it, vary smoothly with the
+transformation without any smoothing pass over the histogram. They
+are not supported in HISTOGRAM_HASHED mode, and in HISTOGRAM_MOMENTS
+mode, the moments are those of the unfolded windows.
 
+Only draws with index in [start, stop) are processed (sample indices
+in the non-stochastic case), which allows to split the computation
+across threads, each filling its own histogram (or sharing one in
+HISTOGRAM_COUNTS mode). No Python API
+function is called, hence the GIL can be released by the caller.
+Random numbers associated with a draw only depend on the seeds and
+the draw index, so the sum of the histograms computed over
+consecutive ranges does not depend on how draws are split.
+
+*/
 
 int joint_histogram(PyArrayObject* JH, 
 		    unsigned int clampI, 
 		    unsigned int clampJ,  
-		    PyArrayIterObject* iterI,
+		    const PyArrayObject* samples,
+		    const PyArrayObject* XYZ,
 		    const PyArrayObject* imJ_padded, 
+		    const PyArrayObject* layout, 
+		    const PyArrayObject* occupancy, 
 		    const PyArrayObject* Tvox, 
-		    long interp)
+		    long interp, 
+		    int mode, 
+		    int sampling, 
+		    npy_intp nsamples, 
+		    long seed, 
+		    npy_intp start, 
+		    npy_intp stop)
 {
-  const signed short* J=(signed short*)imJ_padded->data; 
-  size_t dimJX=imJ_padded->dimensions[0]-2;
-  size_t dimJY=imJ_padded->dimensions[1]-2; 
-  size_t dimJZ=imJ_padded->dimensions[2]-2;  
-  signed short Jnn[8]; 
-  double W[8]; 
-  signed short *bufI, *bufJnn; 
-  double *bufW; 
-  signed short i, j;
-  size_t off;
-  size_t u2 = imJ_padded->dimensions[2]; 
-  size_t u3 = u2+1; 
-  size_t u4 = imJ_padded->dimensions[1]*u2;
-  size_t u5 = u4+1; 
-  size_t u6 = u4+u2; 
-  size_t u7 = u6+1; 
-  double wx, wy, wz, wxwy, wxwz, wywz; 
-  double W0, W2, W3, W4; 
-  int nn, nx, ny, nz;
-  double *H = (double*)PyArray_DATA(JH);  
-  double Tx, Ty, Tz; 
-  double *tvox = (double*)PyArray_DATA(Tvox); 
-  void (*interpolate)(unsigned int, double*, unsigned int, const signed short*, const double*, int, void*); 
-  void* interp_params = NULL; 
-  prng_state rng; 
-
-
-  /* 
-     Check assumptions regarding input arrays. If it fails, the
-     function will return -1 without doing anything else. 
-     
-     iterI : assumed to iterate over a signed short encoded, possibly
-     non-contiguous array.
-     
-     imJ_padded : assumed C-contiguous (last index varies faster) & signed
-     short encoded.
-     
-     H : assumed C-contiguous. 
-     
-     Tvox : assumed C-contiguous: 
-     
-       either a 3x4=12-sized array (or bigger) for an affine transformation
+  DISPATCH(joint_histogram, (JH, clampI, clampJ, samples, XYZ, imJ_padded, layout, 
+			    occupancy, Tvox, interp, mode, sampling, 
+			    nsamples, seed, start, stop)); 
+}
 
-       or a 3xN array for a pre-computed transformation, with N equal
-       to the size of the array corresponding to iterI (no checking
-       done)
-  
-  */
-  if (PyArray_TYPE(iterI->ao) != NPY_SHORT) {
-    fprintf(stderr, "Invalid type for the array iterator\n");
-    return -1; 
-  }
-  if ( (!PyArray_ISCONTIGUOUS(imJ_padded)) || 
-       (!PyArray_ISCONTIGUOUS(JH)) ||
-       (!PyArray_ISCONTIGUOUS(Tvox)) ) {
-    fprintf(stderr, "Some non-contiguous arrays\n");
-    return -1; 
-  }
 
-  /* Reset the source image iterator */
-  PyArray_ITER_RESET(iterI);
+/* 
 
-  /* Set interpolation method */ 
-  if (interp==0) 
-    interpolate = &_pv_interpolation;
-  else if (interp>0) 
-    interpolate = &_tri_interpolation; 
-  else { /* interp < 0 */ 
-    interpolate = &_rand_interpolation;
-    prng_seed(-interp, &rng); 
-    interp_params = (void*)(&rng); 
-  }
+BATCH JOINT HISTOGRAM COMPUTATION.
 
-  /* Re-initialize joint histogram */ 
-  memset((void*)H, 0, clampI*clampJ*sizeof(double));
+Compute the joint histograms H[k] corresponding to K affine
+voxel-to-voxel transformations Tvox[k] in a single pass over the
+source sample draws with index in [start, stop), so that each source
+sample is read once and shared by all transformations. 
 
-  /* Looop over source voxels */
-  while(iterI->index < iterI->size) {
-  
-    /* Source voxel intensity */
-    bufI = (signed short*)PyArray_ITER_DATA(iterI); 
-    i = bufI[0];
-
-    /* Compute the transformed grid coordinates of current voxel */ 
-    Tx = *tvox; tvox++;
-    Ty = *tvox; tvox++;
-    Tz = *tvox; tvox++; 
-
-    /* Test whether the current voxel is below the intensity
-       threshold, or the transformed point is completly outside
-       the reference grid */
-    if ((i>=0) && 
-	(Tx>-1) && (Tx<dimJX) && 
-	(Ty>-1) && (Ty<dimJY) && 
-	(Tz>-1) && (Tz<dimJZ)) {
-	
-      /* 
-	 Nearest neighbor (floor coordinates in the padded
-	 image, hence +1). 
-	 
-	 Notice that using the floor function doubles excetution time.
-	 
-	 FIXME: see if we can replace this with assembler instructions. 
-      */
-      nx = FLOOR(Tx) + 1;
-      ny = FLOOR(Ty) + 1;
-      nz = FLOOR(Tz) + 1;
-      
-      /* The convention for neighbor indexing is as follows:
-       *
-       *   Floor slice        Ceil slice
-       *
-       *     2----6             3----7                     y          
-       *     |    |             |    |                     ^ 
-       *     |    |             |    |                     |
-       *     0----4             1----5                     ---> x
-       */
-      
-      /*** Trilinear interpolation weights.  
-	   Note: wx = nnx + 1 - Tx, where nnx is the location in
-	   the NON-PADDED grid */ 
-      wx = nx - Tx; 
-      wy = ny - Ty;
-      wz = nz - Tz;
-      wxwy = wx*wy;    
-      wxwz = wx*wz;
-      wywz = wy*wz;
-      
-      /*** Prepare buffers */ 
-      bufJnn = Jnn;
-      bufW = W; 
-      
-      /*** Initialize neighbor list */
-      off = nx*u4 + ny*u2 + nz; 
-      nn = 0; 
-      
-      /*** Neighbor 0: (0,0,0) */ 
-      W0 = wxwy*wz; 
-      APPEND_NEIGHBOR(off, W0); 
-      
-      /*** Neighbor 1: (0,0,1) */ 
-      APPEND_NEIGHBOR(off+1, wxwy-W0);
-      
-      /*** Neighbor 2: (0,1,0) */ 
-      W2 = wxwz-W0; 
-      APPEND_NEIGHBOR(off+u2, W2);  
-      
-      /*** Neightbor 3: (0,1,1) */
-      W3 = wx-wxwy-W2;  
-      APPEND_NEIGHBOR(off+u3, W3);  
-      
-      /*** Neighbor 4: (1,0,0) */
-      W4 = wywz-W0;  
-      APPEND_NEIGHBOR(off+u4, W4); 
-      
-      /*** Neighbor 5: (1,0,1) */ 
-      APPEND_NEIGHBOR(off+u5, wy-wxwy-W4);   
-      
-      /*** Neighbor 6: (1,1,0) */ 
-      APPEND_NEIGHBOR(off+u6, wz-wxwz-W4);  
-      
-      /*** Neighbor 7: (1,1,1) */ 
-      APPEND_NEIGHBOR(off+u7, 1-W3-wy-wz+wywz);  
-      
-      /* Update the joint histogram using the desired interpolation technique */ 
-      interpolate(i, H, clampJ, Jnn, W, nn, interp_params); 
-      
-      
-    } /* End of IF TRANSFORMS INSIDE */
-    
-    /* Update source index */ 
-    PyArray_ITER_NEXT(iterI); 
-    
-  } /* End of loop over voxels */ 
-  
+H : assumed C-contiguous with shape (K, clampI, clampJ), or (K,
+clampI, 3) in HISTOGRAM_MOMENTS mode. HISTOGRAM_HASHED and
+HISTOGRAM_COUNTS modes are not supported.
 
-  return 0; 
+Tvox : assumed C-contiguous with shape (K, 3, 4) or (K, 4, 4). 
+
+Other assumptions are as in joint_histogram(). In random
+interpolation mode, a single generator is shared by the K
+transformations.
+
+*/
+
+int joint_histogram_batch(PyArrayObject* JH, 
+			  unsigned int clampI, 
+			  unsigned int clampJ,  
+			  const PyArrayObject* samples,
+			  const PyArrayObject* XYZ,
+			  const PyArrayObject* imJ_padded, 
+			  const PyArrayObject* layout, 
+			  const PyArrayObject* occupancy, 
+			  const PyArrayObject* Tvox, 
+			  long interp, 
+			  int mode, 
+			  int sampling, 
+			  npy_intp nsamples, 
+			  long seed, 
+			  npy_intp start, 
+			  npy_intp stop)
+{
+  DISPATCH(joint_histogram_batch, (JH, clampI, clampJ, samples, XYZ, imJ_padded, 
+				  layout, occupancy, Tvox, interp, mode, 
+				  sampling, nsamples, seed, start, stop)); 
+}
+
+
+/* 
+
+JOINT HISTOGRAM GRADIENT COMPUTATION.
+
+Compute the partial volume (interp=0) or Parzen window
+(interp=PARZEN_INTERPOLATION) joint histogram H together with its
+derivatives with respect to the 12 coefficients of the affine
+voxel-to-voxel transformation Tvox (3x4 or 4x4, C-contiguous), in a
+single pass over the source sample draws with index in [start, stop).
+
+G : assumed C-contiguous with shape (clampI, clampJ, 12), such that
+G[i, j, 4*a+b] is the derivative of H[i, j] with respect to
+Tvox[a, b].
+
+The partial volume weight of a neighbor is a product of per-axis
+factors, each of which is an affine function of the corresponding
+transformed coordinate with slope -1 (floor side) or +1 (ceil
+side). Since the transformed coordinate T[a] depends on Tvox[a, b]
+through the source grid coordinate (x, y, z, 1)[b], the derivatives
+follow from the chain rule. Parzen window contributions S*w[k],
+where S is the sum of the trilinear weights of the unmasked
+neighbors and w[k] the window weights at their weighted mean
+intensity jm, are differentiated likewise through S and jm.
+Derivatives are not defined where transformed points cross the
+target grid boundary or mask; such discontinuities are ignored.
+
+Other assumptions are as in joint_histogram(), except that Tvox
+should be double. 
+
+*/
+
+int joint_histogram_gradient(PyArrayObject* JH, 
+			     PyArrayObject* JG, 
+			     unsigned int clampI, 
+			     unsigned int clampJ,  
+			     const PyArrayObject* samples,
+			     const PyArrayObject* XYZ,
+			     const PyArrayObject* imJ_padded, 
+			     const PyArrayObject* layout, 
+			     const PyArrayObject* occupancy, 
+			     const PyArrayObject* Tvox, 
+			     long interp, 
+			     int sampling, 
+			     npy_intp nsamples, 
+			     long seed, 
+			     npy_intp start, 
+			     npy_intp stop)
+{
+  DISPATCH(joint_histogram_gradient, (JH, JG, clampI, clampJ, samples, XYZ, 
+				     imJ_padded, layout, occupancy, Tvox, 
+				     interp, sampling, nsamples, seed, start, 
+				     stop)); 
 }
 
 
 /* Partial Volume interpolation. See Maes et al, IEEE TMI, 2007. */ 
 static inline void _pv_interpolation(unsigned int i, 
 				     double* H, unsigned int clampJ, 
-				     const signed short* J, 
+				     const int* J, 
 				     const double* W, 
 				     int nn, 
 				     void* params) 
 { 
   int k;
   unsigned int clampJ_i = clampJ*i;
-  const signed short *bufJ = J;
+  const int *bufJ = J;
   const double *bufW = W; 
+  (void)params; 
 
   for(k=0; k<nn; k++, bufJ++, bufW++) 
     H[*bufJ+clampJ_i] += *bufW;
@@ -275,16 +1182,17 @@ static inline void _pv_interpolation(unsigned int i,
 /* Trilinear interpolation. Basic version. */
 static inline void _tri_interpolation(unsigned int i, 
 				      double* H, unsigned int clampJ, 
-				      const signed short* J, 
+				      const int* J, 
 				      const double* W, 
 				      int nn, 
 				      void* params) 
 { 
   int k;
   unsigned int clampJ_i = clampJ*i;
-  const signed short *bufJ = J;
+  const int *bufJ = J;
   const double *bufW = W; 
   double jm, sumW; 
+  (void)params; 
   
   for(k=0, sumW=0.0, jm=0.0; k<nn; k++, bufJ++, bufW++) {
     sumW += *bufW; 
@@ -300,12 +1208,12 @@ static inline void _tri_interpolation(unsigned int i,
 /* Random interpolation. */
 static inline void _rand_interpolation(unsigned int i, 
 				       double* H, unsigned int clampJ, 
-				       const signed short* J, 
+				       const int* J, 
 				       const double* W, 
 				       int nn, 
 				       void* params) 
 { 
-  prng_state* rng = (prng_state*)params; 
+  random_state* rand = (random_state*)params; 
   int k;
   unsigned int clampJ_i = clampJ*i;
   const double *bufW;
@@ -313,10 +1221,12 @@ static inline void _rand_interpolation(unsigned int i,
   
   for(k=0, bufW=W, sumW=0.0; k<nn; k++, bufW++) 
     sumW += *bufW; 
+  if (sumW <= 0.0) 
+    return; 
   
-  draw = sumW*prng_double(rng); 
+  draw = sumW*philox_double(&rand->rng, rand->draw); 
 
-  for(k=0, bufW=W, sumW=0.0; k<nn; k++, bufW++) {
+  for(k=0, bufW=W, sumW=0.0; k<nn-1; k++, bufW++) {
     sumW += *bufW; 
     if (sumW > draw) 
       break; 
@@ -327,30 +1237,274 @@ static inline void _rand_interpolation(unsigned int i,
   return; 
 }
 
+/* 
+   Moment versions of the above interpolation methods: H points to
+   the (clampI, 3) array of target intensity moments given the source
+   intensity, and clampJ is 3.
+*/ 
+#define ACCUMULATE_MOMENTS(m, j, w)		\
+  m[0] += w;					\
+  m[1] += (w)*(j);				\
+  m[2] += (w)*(j)*(j)
+
+static inline void _pv_moments(unsigned int i, 
+			       double* H, unsigned int clampJ, 
+			       const int* J, 
+			       const double* W, 
+			       int nn, 
+			       void* params) 
+{ 
+  int k;
+  double *m = H + clampJ*i; 
+  (void)params; 
+
+  for(k=0; k<nn; k++) {
+    ACCUMULATE_MOMENTS(m, (double)J[k], W[k]); 
+  }
+
+  return; 
+}
+
+static inline void _tri_moments(unsigned int i, 
+				double* H, unsigned int clampJ, 
+				const int* J, 
+				const double* W, 
+				int nn, 
+				void* params) 
+{ 
+  int k;
+  double *m = H + clampJ*i; 
+  double jm, sumW; 
+  (void)params; 
+  
+  for(k=0, sumW=0.0, jm=0.0; k<nn; k++) {
+    sumW += W[k]; 
+    jm += W[k]*J[k]; 
+  }
+  if (sumW > 0.0) {
+    jm = (double)UROUND(jm/sumW); 
+    ACCUMULATE_MOMENTS(m, jm, sumW); 
+  }
+  return; 
+}
+
+static inline void _rand_moments(unsigned int i, 
+				 double* H, unsigned int clampJ, 
+				 const int* J, 
+				 const double* W, 
+				 int nn, 
+				 void* params) 
+{ 
+  random_state* rand = (random_state*)params; 
+  int k;
+  double *m = H + clampJ*i; 
+  double sumW, draw; 
+  
+  for(k=0, sumW=0.0; k<nn; k++) 
+    sumW += W[k]; 
+  if (sumW <= 0.0) 
+    return; 
+  
+  draw = sumW*philox_double(&rand->rng, rand->draw); 
+
+  for(k=0, sumW=0.0; k<nn-1; k++) {
+    sumW += W[k]; 
+    if (sumW > draw) 
+      break; 
+  }
+    
+  ACCUMULATE_MOMENTS(m, (double)J[k], 1.0); 
+  
+  return; 
+}
+
+/* Parzen window interpolation, see PARZEN WINDOWS. */ 
+static inline void _parzen_interpolation(unsigned int i, 
+					 double* H, unsigned int clampJ, 
+					 const int* J, 
+					 const double* W, 
+					 int nn, 
+					 void* params) 
+{ 
+  int k, j0;
+  double *h = H + clampJ*i; 
+  double jm, sumW, w[4]; 
+  (void)params; 
+  
+  for(k=0, sumW=0.0, jm=0.0; k<nn; k++) {
+    sumW += W[k]; 
+    jm += W[k]*J[k]; 
+  }
+  if (sumW <= 0.0) 
+    return; 
+  j0 = _parzen_window(w, NULL, jm/sumW); 
+  for(k=0; k<4; k++) 
+    h[PARZEN_BIN(j0+k-1, clampJ)] += sumW*w[k]; 
+
+  return; 
+}
+
+static inline void _parzen_moments(unsigned int i, 
+				   double* H, unsigned int clampJ, 
+				   const int* J, 
+				   const double* W, 
+				   int nn, 
+				   void* params) 
+{ 
+  int k;
+  double *m = H + clampJ*i; 
+  double jm, sumW; 
+  (void)params; 
+  
+  for(k=0, sumW=0.0, jm=0.0; k<nn; k++) {
+    sumW += W[k]; 
+    jm += W[k]*J[k]; 
+  }
+  if (sumW > 0.0) {
+    jm /= sumW; 
+    ACCUMULATE_MOMENTS(m, jm, sumW); 
+    m[2] += PARZEN_VARIANCE*sumW; 
+  }
+  return; 
+}
+
+/* 
+   Hashed histogram versions of the interpolation methods: H points
+   to a hashed histogram (see HASHED HISTOGRAMS) and clampJ is its
+   capacity minus one.
+*/ 
+static inline void _pv_hashed(unsigned int i, 
+			      double* H, unsigned int clampJ, 
+			      const int* J, 
+			      const double* W, 
+			      int nn, 
+			      void* params) 
+{ 
+  int k;
+  npy_intp key = (npy_intp)i*HASHED_KEY_BASE + 1; 
+  (void)params; 
+
+  for(k=0; k<nn; k++) 
+    if (W[k] > 0) 
+      _hashed_add(H, clampJ, key+J[k], W[k]); 
+
+  return; 
+}
+
+static inline void _tri_hashed(unsigned int i, 
+			       double* H, unsigned int clampJ, 
+			       const int* J, 
+			       const double* W, 
+			       int nn, 
+			       void* params) 
+{ 
+  int k;
+  double jm, sumW; 
+  (void)params; 
+  
+  for(k=0, sumW=0.0, jm=0.0; k<nn; k++) {
+    sumW += W[k]; 
+    jm += W[k]*J[k]; 
+  }
+  if (sumW > 0.0) 
+    _hashed_add(H, clampJ, (npy_intp)i*HASHED_KEY_BASE + UROUND(jm/sumW) + 1, 
+		sumW); 
+  return; 
+}
+
+static inline void _rand_hashed(unsigned int i, 
+				double* H, unsigned int clampJ, 
+				const int* J, 
+				const double* W, 
+				int nn, 
+				void* params) 
+{ 
+  random_state* rand = (random_state*)params; 
+  int k;
+  double sumW, draw; 
+  
+  for(k=0, sumW=0.0; k<nn; k++) 
+    sumW += W[k]; 
+  if (sumW <= 0.0) 
+    return; 
+  
+  draw = sumW*philox_double(&rand->rng, rand->draw); 
+
+  for(k=0, sumW=0.0; k<nn-1; k++) {
+    sumW += W[k]; 
+    if (sumW > draw) 
+      break; 
+  }
+    
+  _hashed_add(H, clampJ, (npy_intp)i*HASHED_KEY_BASE + J[k] + 1, 1.0); 
+  
+  return; 
+}
+
+
+/* Random interpolation accumulating uint32 counts, see
+   HISTOGRAM_COUNTS: H points to a count histogram. */ 
+static inline void _rand_counts(unsigned int i, 
+				double* H, unsigned int clampJ, 
+				const int* J, 
+				const double* W, 
+				int nn, 
+				void* params) 
+{ 
+  random_state* rand = (random_state*)params; 
+  npy_uint32* C = (npy_uint32*)H; 
+  int k;
+  double sumW, draw; 
+  
+  for(k=0, sumW=0.0; k<nn; k++) 
+    sumW += W[k]; 
+  if (sumW <= 0.0) 
+    return; 
+  
+  draw = sumW*philox_double(&rand->rng, rand->draw); 
+
+  for(k=0, sumW=0.0; k<nn-1; k++) {
+    sumW += W[k]; 
+    if (sumW > draw) 
+      break; 
+  }
+    
+  ATOMIC_INCREMENT(C + (size_t)clampJ*i + J[k]); 
+  
+  return; 
+}
+
+
+int hashed_histogram_merge(PyArrayObject* JH, const PyArrayObject* JP)
+{
+  double *H = (double*)PyArray_DATA(JH); 
+  const double *P = (const double*)PyArray_DATA(JP); 
+  npy_intp s, C, mask; 
+
+  if ((_check_hashed(JH) < 0) || (_check_hashed(JP) < 0))
+    return -1; 
+  mask = PyArray_DIM(JH, 0) - 2; 
+  C = PyArray_DIM(JP, 0) - 1; 
+  for (s=0; s<C; s++) 
+    if (P[2*s] > 0) 
+      _hashed_add(H, mask, (npy_intp)P[2*s], P[2*s+1]); 
+  H[2*(mask+1)+1] += P[2*C+1]; 
+
+  return 0; 
+}
+
 
 /* 
    A function to compute the weighted median in one-dimensional
-   histogram.
+   histogram of given size, whose consecutive entries are offset
+   doubles apart.
  */
-int L1_moments(double* n_, double* median_, double* dev_, 
-	       const PyArrayObject* H)
+static void _L1_moments(double* n_, double* median_, double* dev_, 
+			const double* h, unsigned int size, npy_intp offset)
 {
-  int i, med;
+  unsigned int i, med;
   double median, dev, n, cpdf, lim;
   const double *buf;
-  const double* h;
-  unsigned int size;
-  unsigned int offset; 
-
-  if (PyArray_TYPE(H) != NPY_DOUBLE) {
-    fprintf(stderr, "Input array should be double\n");
-    return -1; 
-  }
-
-  /* Initialize */
-  h = (const double*)PyArray_DATA(H);
-  size = PyArray_DIM(H, 0); 
-  offset = PyArray_STRIDE(H, 0)/sizeof(double); 
 
   n = median = dev = 0; 
   cpdf = 0;
@@ -371,7 +1525,7 @@ int L1_moments(double* n_, double* median_, double* dev_,
       i ++;
       buf += offset;
       cpdf += *buf;
-      dev += - i*(*buf);
+      dev += - (double)i*(*buf);
     }
     
     /* 
@@ -398,7 +1552,7 @@ int L1_moments(double* n_, double* median_, double* dev_,
     if (med < size) {
       buf = h + med*offset;
       for (i=med; i<size; i ++, buf += offset) 
-	dev += i*(*buf);
+	dev += (double)i*(*buf);
     }
     
     dev /= n; 
@@ -409,6 +1563,46 @@ int L1_moments(double* n_, double* median_, double* dev_,
   median_[0] = median; 
   dev_[0] = dev; 
 
+  return;
+}
+
+
+int L1_moments(double* n_, double* median_, double* dev_, 
+	       const PyArrayObject* H)
+{
+  if (PyArray_TYPE(H) != NPY_DOUBLE) {
+    fprintf(stderr, "Input array should be double\n");
+    return -1; 
+  }
+
+  _L1_moments(n_, median_, dev_, (const double*)PyArray_DATA(H), 
+	      PyArray_DIM(H, 0), PyArray_STRIDE(H, 0)/sizeof(double)); 
+
+  return 0;           
+}
+
+
+int L1_moments_rows(double* n, double* median, double* dev, 
+		    const PyArrayObject* H)
+{
+  const double* h;
+  unsigned int i, dimI, dimJ; 
+  npy_intp strideI, strideJ; 
+
+  if ((PyArray_TYPE(H) != NPY_DOUBLE) || (PyArray_NDIM(H) != 2)) {
+    fprintf(stderr, "Input array should be double and two-dimensional\n");
+    return -1; 
+  }
+
+  h = (const double*)PyArray_DATA(H);
+  dimI = PyArray_DIM(H, 0); 
+  dimJ = PyArray_DIM(H, 1); 
+  strideI = PyArray_STRIDE(H, 0)/sizeof(double); 
+  strideJ = PyArray_STRIDE(H, 1)/sizeof(double); 
+
+  for (i=0; i<dimI; i++, h+=strideI) 
+    _L1_moments(n+i, median+i, dev+i, h, dimJ, strideJ); 
+
   return 0;           
 }
 
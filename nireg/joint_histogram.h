@@ -26,6 +26,29 @@ extern "C" {
 
 #include <numpy/arrayobject.h>
 
+  /* Side of the cells of target occupancy maps, see below */ 
+#define OCCUPANCY_CELL 8
+
+  /* Accumulation modes of the joint histogram routines, see below */ 
+#define HISTOGRAM_DENSE 0
+#define HISTOGRAM_MOMENTS 1
+#define HISTOGRAM_HASHED 2
+#define HISTOGRAM_COUNTS 3
+
+  /* Interpolation method spreading samples over histogram bins with
+     a cubic B-spline Parzen window, see below */ 
+#define PARZEN_INTERPOLATION 2
+
+  /* Instruction sets of the affine kernels, see joint_histogram_simd */ 
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_AVX 2
+#define SIMD_AVX512 3
+
+  /* Key base of hashed histogram entries, see below: clamped
+     intensities, either signed short or unsigned char, are lower */ 
+#define HASHED_KEY_BASE 32768
+
   /* 
      Update a pre-allocated joint histogram. Important notice: in all
      computations, H will be assumed C-contiguous.
@@ -39,19 +62,162 @@ extern "C" {
      interp: 
        0 - PV interpolation
        1 - TRILINEAR interpolation 
+       2 - PARZEN window interpolation: the trilinearly interpolated
+       target intensity is spread over the 4 nearest bins with a
+       cubic B-spline kernel, as in Mattes et al, IEEE TMI, 2003
        <0 - RANDOM interpolation with seed=-interp
+       Other positive values are rejected.
+
+     The source image is given as a packed list of N samples holding
+     the intensities of unmasked voxels and XYZ, of shape (3, N),
+     their grid coordinates.
+
+     The padded target image imJ_padded is stored according to
+     layout, a (3, L) npy_intp array of per-axis offsets of the grid
+     points, which allows for C order as well as cache-blocked
+     layouts. See joint_histogram.c for details.
+
+     occupancy is either empty or an unsigned char array with one
+     entry per cell of OCCUPANCY_CELL^3 grid points of imJ_padded,
+     which is zero if no sample falling in the cell can have unmasked
+     neighbors. Such samples are then rejected with a single lookup.
+
+     mode selects what is accumulated in H: 
+       HISTOGRAM_DENSE - the joint histogram
+       HISTOGRAM_MOMENTS - a (clampI, 3) array of target intensity
+       moments of order 0, 1 and 2 given each source intensity, in
+       which case clampJ is ignored
+       HISTOGRAM_HASHED - a hashed histogram of the non-empty joint
+       histogram entries (see hashed_histogram_merge), in which case
+       clampI and clampJ are ignored
+       HISTOGRAM_COUNTS - the joint histogram as a uint32 array of
+       draw counts, with random interpolation only. Counts are
+       incremented atomically and H is not re-initialized, so that
+       blocks processed concurrently may share a single histogram
+
+     Tvox is either a 3x4 (or 4x4) affine voxel-to-voxel
+     transformation, applied on the fly to the source grid
+     coordinates, or a Nx3 array of pre-computed transformed
+     coordinates, either double or int for 16.16 fixed-point
+     values. See joint_histogram.c for details.
+
+     sampling: 
+       0 - all source samples are used
+       1 - RANDOM sampling of nsamples source samples 
+       2 - STRATIFIED sampling of nsamples source samples 
+     where the subset is drawn on the fly using seed. 
+
+     Random draws are indexed by the draw number, hence results
+     summed over blocks do not depend on the block boundaries.
+
+     Only draws with index in [start, stop) are accounted for. No
+     Python API function is called, so that several blocks may be
+     processed concurrently in threads that do not hold the GIL.
   */ 
   extern int joint_histogram(PyArrayObject* H, 
 			     unsigned int clampI, 
 			     unsigned int clampJ,  
-			     PyArrayIterObject* iterI,
+			     const PyArrayObject* samples,
+			     const PyArrayObject* XYZ,
 			     const PyArrayObject* imJ_padded, 
+			     const PyArrayObject* layout, 
+			     const PyArrayObject* occupancy, 
 			     const PyArrayObject* Tvox, 
-			     long interp); 
+			     long interp, 
+			     int mode,
+			     int sampling,
+			     npy_intp nsamples,
+			     long seed,
+			     npy_intp start, 
+			     npy_intp stop); 
+
+  /* 
+     Joint histograms for a batch of K affine voxel-to-voxel
+     transformations, computed in a single pass over the source
+     image. H is C-contiguous with shape (K, clampI, clampJ) and Tvox
+     with shape (K, 3, 4) or (K, 4, 4). Hashed and count histograms
+     are not supported. See joint_histogram.c for details.
+  */ 
+  extern int joint_histogram_batch(PyArrayObject* H, 
+				   unsigned int clampI, 
+				   unsigned int clampJ,  
+				   const PyArrayObject* samples,
+				   const PyArrayObject* XYZ,
+				   const PyArrayObject* imJ_padded, 
+				   const PyArrayObject* layout, 
+				   const PyArrayObject* occupancy, 
+				   const PyArrayObject* Tvox, 
+				   long interp, 
+				   int mode,
+				   int sampling,
+				   npy_intp nsamples,
+				   long seed,
+				   npy_intp start, 
+				   npy_intp stop); 
+
+  /* 
+     Joint histogram H together with its gradient G with respect to
+     the coefficients of an affine voxel-to-voxel transformation Tvox,
+     using either PV (interp=0) or PARZEN window interpolation. G is
+     C-contiguous with shape (clampI, clampJ, 12). See
+     joint_histogram.c for details.
+  */ 
+  extern int joint_histogram_gradient(PyArrayObject* H, 
+				      PyArrayObject* G, 
+				      unsigned int clampI, 
+				      unsigned int clampJ,  
+				      const PyArrayObject* samples,
+				      const PyArrayObject* XYZ,
+				      const PyArrayObject* imJ_padded, 
+				      const PyArrayObject* layout, 
+				      const PyArrayObject* occupancy, 
+				      const PyArrayObject* Tvox, 
+				      long interp, 
+				      int sampling,
+				      npy_intp nsamples,
+				      long seed,
+				      npy_intp start, 
+				      npy_intp stop); 
+
+  /*
+     Select the instruction set used to transform source samples in
+     the affine case: the highest one not above level that both the
+     build and the CPU support. Returns the selected instruction set,
+     or the current one if level is negative. The default is the
+     highest supported one. Results only differ by rounding between
+     instruction sets.
+  */ 
+  extern int joint_histogram_simd(int level); 
+
+  /*
+     Hashed histograms are double C-contiguous arrays of shape (C+1,
+     2), where the capacity C is a power of two. Each of the first C
+     rows is either free, i.e. zero, or holds the key
+     i*HASHED_KEY_BASE+j+1 of a non-empty joint histogram entry (i,
+     j) followed by its value. The last row holds the number of
+     occupied rows and the number of contributions dropped because
+     the table was half full, in which case the histogram should be
+     recomputed with a larger capacity. Memory thus scales with the
+     number of non-empty entries rather than with clampI x clampJ.
+
+     hashed_histogram_merge adds the entries of P to H, whose
+     capacities may differ. Returns -1 if either is not a hashed
+     histogram, 0 otherwise.
+  */ 
+  extern int hashed_histogram_merge(PyArrayObject* H, 
+				    const PyArrayObject* P);
 
   extern int L1_moments(double* n_, double* median_, double* dev_, 
 			const PyArrayObject* H);
 
+  /*
+     L1 moments of each row of a two-dimensional double array H,
+     stored in the arrays n, median and dev of size H.shape[0]. H may
+     be non-contiguous, e.g. a transposed view to get column moments.
+  */ 
+  extern int L1_moments_rows(double* n, double* median, double* dev, 
+			     const PyArrayObject* H);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,728 @@
+/* 
+   Joint histogram kernels specialized for a pair of clamped source
+   and target intensity types. This file is included by
+   joint_histogram.c once for each pair, with the following macros
+   defined:
+
+   SOURCE_TYPE, TARGET_TYPE : C types of the source samples and of
+   the padded target image
+
+   LOAD_SOURCE(p, n), LOAD_TARGET(p, n) : intensity of p[n] as an
+   int, negative for masked voxels
+
+   SPECIALIZE(name) : name suffixed with the type pair
+
+   See joint_histogram.c for the documentation of the kernels. 
+*/ 
+
+#define APPEND_NEIGHBOR(q, w)			\
+  j = LOAD_TARGET(J, q);			\
+  if (j>=0) {					\
+    *bufJnn = j; bufJnn ++; 			\
+    *bufW = w; bufW ++;				\
+    nn ++; }
+
+
+/* 
+   Update the joint histogram H with a source voxel of intensity i
+   whose floor neighbor is the grid point (nx, ny, nz) of the padded
+   target image J, with trilinear weights (wx, wy, wz) along each
+   axis, using the given interpolation method. 
+*/ 
+static inline void SPECIALIZE(_update_neighbors)(double* H, 
+						 unsigned int clampJ, 
+						 int i, 
+						 int nx, 
+						 int ny, 
+						 int nz, 
+						 double wx, 
+						 double wy, 
+						 double wz, 
+						 const TARGET_TYPE* J, 
+						 const target_layout* layout, 
+						 interpolation interpolate, 
+						 void* interp_params)
+{
+  int Jnn[8]; 
+  double W[8]; 
+  int *bufJnn; 
+  double *bufW; 
+  int j;
+  npy_intp x0 = layout->x[nx], x1 = layout->x[nx+1]; 
+  npy_intp y0 = layout->y[ny], y1 = layout->y[ny+1]; 
+  npy_intp z0 = layout->z[nz], z1 = layout->z[nz+1]; 
+  double wxwy, wxwz, wywz; 
+  double W0, W2, W3, W4; 
+  int nn;
+
+  /* The convention for neighbor indexing is as follows:
+   *
+   *   Floor slice        Ceil slice
+   *
+   *     2----6             3----7                     y          
+   *     |    |             |    |                     ^ 
+   *     |    |             |    |                     |
+   *     0----4             1----5                     ---> x
+   */
+    
+  /*** Trilinear interpolation weights */ 
+  wxwy = wx*wy;    
+  wxwz = wx*wz;
+  wywz = wy*wz;
+    
+  /*** Prepare buffers */ 
+  bufJnn = Jnn;
+  bufW = W; 
+    
+  /*** Initialize neighbor list */
+  nn = 0; 
+    
+  /*** Neighbor 0: (0,0,0) */ 
+  W0 = wxwy*wz; 
+  APPEND_NEIGHBOR(x0+y0+z0, W0); 
+    
+  /*** Neighbor 1: (0,0,1) */ 
+  APPEND_NEIGHBOR(x0+y0+z1, wxwy-W0);
+    
+  /*** Neighbor 2: (0,1,0) */ 
+  W2 = wxwz-W0; 
+  APPEND_NEIGHBOR(x0+y1+z0, W2);  
+    
+  /*** Neightbor 3: (0,1,1) */
+  W3 = wx-wxwy-W2;  
+  APPEND_NEIGHBOR(x0+y1+z1, W3);  
+    
+  /*** Neighbor 4: (1,0,0) */
+  W4 = wywz-W0;  
+  APPEND_NEIGHBOR(x1+y0+z0, W4); 
+    
+  /*** Neighbor 5: (1,0,1) */ 
+  APPEND_NEIGHBOR(x1+y0+z1, wy-wxwy-W4);   
+    
+  /*** Neighbor 6: (1,1,0) */ 
+  APPEND_NEIGHBOR(x1+y1+z0, wz-wxwz-W4);  
+    
+  /*** Neighbor 7: (1,1,1) */ 
+  APPEND_NEIGHBOR(x1+y1+z1, 1-W3-wy-wz+wywz);  
+    
+  /* Update the joint histogram using the desired interpolation technique */ 
+  interpolate(i, H, clampJ, Jnn, W, nn, interp_params); 
+
+  return; 
+}
+
+
+/* 
+   Update the joint histogram H with a source voxel of intensity i
+   mapped to the grid coordinates (Tx, Ty, Tz) of the padded target
+   image J, using the given interpolation method. 
+*/ 
+static inline void SPECIALIZE(_update_histogram)(double* H, 
+						 unsigned int clampJ, 
+						 int i, 
+						 double Tx, 
+						 double Ty, 
+						 double Tz, 
+						 const TARGET_TYPE* J, 
+						 size_t dimJX, 
+						 size_t dimJY, 
+						 size_t dimJZ, 
+						 const target_layout* layout, 
+						 const target_occupancy* occupancy, 
+						 interpolation interpolate, 
+						 void* interp_params)
+{
+  int nx, ny, nz;
+
+  /* Test whether the current voxel is below the intensity
+     threshold, or the transformed point is completly outside
+     the reference grid */
+  if ((i>=0) && 
+      (Tx>-1) && (Tx<dimJX) && 
+      (Ty>-1) && (Ty<dimJY) && 
+      (Tz>-1) && (Tz<dimJZ)) {
+      
+    /* 
+       Nearest neighbor (floor coordinates in the padded image, hence
+       +1). Since coordinates are greater than -1, this is the
+       truncation of T+1, which needs no branch for negative values.
+    */
+    nx = (int)(Tx+1);
+    ny = (int)(Ty+1);
+    nz = (int)(Tz+1);
+    if (!OCCUPIED(occupancy, nx, ny, nz)) 
+      return; 
+    
+    /* Note: wx = nnx + 1 - Tx, where nnx is the location in the
+       NON-PADDED grid */ 
+    SPECIALIZE(_update_neighbors)(H, clampJ, i, nx, ny, nz, 
+				  nx - Tx, ny - Ty, nz - Tz, J, layout, 
+				  interpolate, interp_params); 
+    
+  } /* End of IF TRANSFORMS INSIDE */
+
+  return; 
+}
+
+
+/* 
+   Gather the intensities and grid coordinates of the source samples
+   of draws k to k+SAMPLE_BLOCK-1, or stop-1 if lower, and return the
+   number of samples gathered. Remaining block entries are filled
+   with a negative intensity. 
+*/ 
+static inline int SPECIALIZE(_gather_block)(int* i, 
+					    int* x, 
+					    int* y, 
+					    int* z, 
+					    npy_intp k, 
+					    npy_intp stop, 
+					    int sampling, 
+					    npy_intp N, 
+					    double stratum, 
+					    const philox_state* rng, 
+					    const SOURCE_TYPE* bufI, 
+					    const int* X, 
+					    const int* Y, 
+					    const int* Z)
+{
+  int b, nb = (stop-k < SAMPLE_BLOCK) ? (int)(stop-k) : SAMPLE_BLOCK; 
+  npy_intp n; 
+
+  for (b=0; b<nb; b++) {
+    n = _draw_sample(k+b, sampling, N, stratum, rng); 
+    i[b] = LOAD_SOURCE(bufI, n); 
+    x[b] = X[n]; 
+    y[b] = Y[n]; 
+    z[b] = Z[n]; 
+  }
+  for (; b<SAMPLE_BLOCK; b++) {
+    i[b] = -1; 
+    x[b] = y[b] = z[b] = 0; 
+  }
+
+  return nb; 
+}
+
+
+static int SPECIALIZE(joint_histogram)(PyArrayObject* JH, 
+				       unsigned int clampI, 
+				       unsigned int clampJ,  
+				       const PyArrayObject* samples,
+				       const PyArrayObject* XYZ,
+				       const PyArrayObject* imJ_padded, 
+				       const PyArrayObject* layout, 
+				       const PyArrayObject* occupancy, 
+				       const PyArrayObject* Tvox, 
+				       long interp, 
+				       int mode, 
+				       int sampling, 
+				       npy_intp nsamples, 
+				       long seed, 
+				       npy_intp start, 
+				       npy_intp stop)
+{
+  const TARGET_TYPE* J=(TARGET_TYPE*)imJ_padded->data; 
+  size_t dimJX=imJ_padded->dimensions[0]-2;
+  size_t dimJY=imJ_padded->dimensions[1]-2; 
+  size_t dimJZ=imJ_padded->dimensions[2]-2;  
+  double dims[3]; 
+  npy_int64 lims[3]; 
+  double tclip[12]; 
+  double *H = (double*)PyArray_DATA(JH);  
+  double Tx, Ty, Tz; 
+  const double *tvox = (double*)PyArray_DATA(Tvox); 
+  const int *tfix = (int*)PyArray_DATA(Tvox); 
+  int affine = (PyArray_DIM(Tvox, PyArray_NDIM(Tvox)-1) == 4); 
+  int fixed = _check_transform(Tvox, 1); 
+  const SOURCE_TYPE *bufI = (SOURCE_TYPE*)PyArray_DATA(samples); 
+  const int *X=NULL, *Y=NULL, *Z=NULL; 
+  npy_intp k, n, N = PyArray_SIZE(samples), size, e, r, r0, r1; 
+  int ib[SAMPLE_BLOCK]; 
+  int xb[SAMPLE_BLOCK], yb[SAMPLE_BLOCK], zb[SAMPLE_BLOCK]; 
+  double wx[SAMPLE_BLOCK], wy[SAMPLE_BLOCK], wz[SAMPLE_BLOCK]; 
+  int nx[SAMPLE_BLOCK], ny[SAMPLE_BLOCK], nz[SAMPLE_BLOCK]; 
+  unsigned int inside; 
+  transform_block transform = _transform_block_method(); 
+  int b, nb; 
+  target_layout L; 
+  target_occupancy O; 
+  double stratum = 1; 
+  interpolation interpolate; 
+  void* interp_params = NULL; 
+  random_state rand; 
+  philox_state srng; 
+
+  /* 
+     Check assumptions regarding input arrays. If it fails, the
+     function will return -1 without doing anything else. 
+  */
+  if ((_check_samples(samples, XYZ, affine) < 0) || 
+      (_init_layout(&L, layout, imJ_padded) < 0) || 
+      (_init_occupancy(&O, occupancy, imJ_padded) < 0) || 
+      (_check_mode(mode, interp) < 0) || 
+      ((mode == HISTOGRAM_HASHED) && (_check_hashed(JH) < 0)) || 
+      ((mode == HISTOGRAM_COUNTS) && (_check_counts(JH) < 0)) || 
+      (fixed < 0)) 
+    return -1; 
+  if ( (!PyArray_ISCONTIGUOUS(imJ_padded)) || 
+       (!PyArray_ISCONTIGUOUS(JH)) ||
+       (!PyArray_ISCONTIGUOUS(Tvox)) ) {
+    fprintf(stderr, "Some non-contiguous arrays\n");
+    return -1; 
+  }
+  if (affine) {
+    X = (int*)PyArray_DATA(XYZ); 
+    Y = X + N; 
+    Z = Y + N; 
+  }
+
+  /* Restrict to the draws of the current block */
+  size = _init_sampling(sampling, N, nsamples, seed, &stratum, &srng); 
+  if (stop > size)
+    stop = size; 
+  if (start < 0)
+    start = 0; 
+
+  /* Set interpolation method */ 
+  interpolate = _interpolation_method(interp, mode, &rand, &interp_params); 
+  if (mode == HISTOGRAM_MOMENTS) 
+    clampJ = 3; 
+  else if (mode == HISTOGRAM_HASHED) 
+    clampJ = (unsigned int)(PyArray_DIM(JH, 0) - 2); 
+
+  /* Re-initialize joint histogram, except shared count histograms */ 
+  if (mode == HISTOGRAM_HASHED) 
+    memset((void*)H, 0, PyArray_NBYTES(JH));
+  else if (mode != HISTOGRAM_COUNTS) 
+    memset((void*)H, 0, clampI*clampJ*sizeof(double));
+
+  dims[0] = dimJX; 
+  dims[1] = dimJY; 
+  dims[2] = dimJZ; 
+  lims[0] = (dimJX+1) << FIXED_SHIFT; 
+  lims[1] = (dimJY+1) << FIXED_SHIFT; 
+  lims[2] = (dimJZ+1) << FIXED_SHIFT; 
+
+  /* 
+     Affine case: loop over blocks of source samples, whose
+     transformed coordinates and interpolation weights are computed
+     using vector instructions, or integer arithmetic in
+     fixed-point. If all samples are drawn, rows of samples are first
+     clipped to the target grid (see ROW CLIPPING). 
+  */
+  if (affine) {
+    for (k=0; k<12; k++) 
+      tclip[k] = fixed ? (double)tfix[k]/FIXED_ONE : tvox[k]; 
+    for (k=start; k<stop; k=e) {
+      if (sampling == 0) {
+	e = _row_end(X, Y, k, stop); 
+	_clip_row(&r0, &r1, Z, k, e, X[k], Y[k], tclip, dims); 
+      }
+      else 
+	r0 = k, r1 = e = stop; 
+      for (r=r0; r<r1; r+=SAMPLE_BLOCK) {
+	nb = SPECIALIZE(_gather_block)(ib, xb, yb, zb, r, r1, sampling, N, 
+				       stratum, &srng, bufI, X, Y, Z); 
+	if (fixed) 
+	  inside = _transform_block_fixed(nx, ny, nz, wx, wy, wz, 
+					  xb, yb, zb, tfix, lims); 
+	else 
+	  inside = transform(nx, ny, nz, wx, wy, wz, 
+			     xb, yb, zb, tvox, dims); 
+	for (b=0; b<nb; b++) {
+	  rand.draw = r+b; 
+	  if ((ib[b]>=0) && ((inside >> b) & 1) && 
+	      OCCUPIED(&O, nx[b], ny[b], nz[b])) 
+	    SPECIALIZE(_update_neighbors)(H, clampJ, ib[b], 
+					  nx[b], ny[b], nz[b], 
+					  wx[b], wy[b], wz[b], J, &L, 
+					  interpolate, interp_params); 
+	}
+      }
+    }
+    return 0; 
+  }
+
+  /* Looop over source samples with pre-computed transformed coordinates */
+  for (k=start; k<stop; k++) {
+    n = _draw_sample(k, sampling, N, stratum, &srng); 
+    rand.draw = k; 
+    if (fixed) {
+      ib[0] = LOAD_SOURCE(bufI, n); 
+      if ((ib[0]>=0) && 
+	  _fixed_neighbor(nx, wx, tfix[3*n], lims[0]) && 
+	  _fixed_neighbor(ny, wy, tfix[3*n+1], lims[1]) && 
+	  _fixed_neighbor(nz, wz, tfix[3*n+2], lims[2]) && 
+	  OCCUPIED(&O, nx[0], ny[0], nz[0])) 
+	SPECIALIZE(_update_neighbors)(H, clampJ, ib[0], nx[0], ny[0], nz[0], 
+				      wx[0], wy[0], wz[0], J, &L, 
+				      interpolate, interp_params); 
+      continue; 
+    }
+    Tx = tvox[3*n]; 
+    Ty = tvox[3*n+1]; 
+    Tz = tvox[3*n+2]; 
+
+    /* Update the joint histogram */ 
+    SPECIALIZE(_update_histogram)(H, clampJ, LOAD_SOURCE(bufI, n), 
+				  Tx, Ty, Tz, J, dimJX, dimJY, dimJZ, &L, &O, 
+				  interpolate, interp_params); 
+
+  } /* End of loop over samples */ 
+
+  return 0; 
+}
+
+
+static int SPECIALIZE(joint_histogram_batch)(PyArrayObject* JH, 
+					     unsigned int clampI, 
+					     unsigned int clampJ,  
+					     const PyArrayObject* samples,
+					     const PyArrayObject* XYZ,
+					     const PyArrayObject* imJ_padded, 
+					     const PyArrayObject* layout, 
+					     const PyArrayObject* occupancy, 
+					     const PyArrayObject* Tvox, 
+					     long interp, 
+					     int mode, 
+					     int sampling, 
+					     npy_intp nsamples, 
+					     long seed, 
+					     npy_intp start, 
+					     npy_intp stop)
+{
+  const TARGET_TYPE* J=(TARGET_TYPE*)imJ_padded->data; 
+  size_t dimJX=imJ_padded->dimensions[0]-2;
+  size_t dimJY=imJ_padded->dimensions[1]-2; 
+  size_t dimJZ=imJ_padded->dimensions[2]-2;  
+  size_t clampIJ; 
+  double *H = (double*)PyArray_DATA(JH);  
+  const double *tvox = (double*)PyArray_DATA(Tvox), *t; 
+  const int *tfix = (int*)PyArray_DATA(Tvox); 
+  int fixed = _check_transform(Tvox, 1); 
+  const SOURCE_TYPE *bufI = (SOURCE_TYPE*)PyArray_DATA(samples); 
+  const int *X, *Y, *Z; 
+  npy_intp d, N = PyArray_SIZE(samples), size; 
+  double stratum = 1; 
+  size_t K, k, stride; 
+  double dims[3]; 
+  npy_int64 lims[3]; 
+  int ib[SAMPLE_BLOCK]; 
+  int xb[SAMPLE_BLOCK], yb[SAMPLE_BLOCK], zb[SAMPLE_BLOCK]; 
+  double wx[SAMPLE_BLOCK], wy[SAMPLE_BLOCK], wz[SAMPLE_BLOCK]; 
+  int nx[SAMPLE_BLOCK], ny[SAMPLE_BLOCK], nz[SAMPLE_BLOCK]; 
+  unsigned int inside; 
+  transform_block transform = _transform_block_method(); 
+  int b, nb; 
+  target_layout L; 
+  target_occupancy O; 
+  interpolation interpolate; 
+  void* interp_params = NULL; 
+  random_state rand; 
+  philox_state srng; 
+
+  /* Check assumptions regarding input arrays */ 
+  if ((_check_samples(samples, XYZ, 1) < 0) || 
+      (_init_layout(&L, layout, imJ_padded) < 0) || 
+      (_init_occupancy(&O, occupancy, imJ_padded) < 0) || 
+      (fixed < 0)) 
+    return -1; 
+  if ( (!PyArray_ISCONTIGUOUS(imJ_padded)) || 
+       (!PyArray_ISCONTIGUOUS(JH)) ||
+       (!PyArray_ISCONTIGUOUS(Tvox)) ) {
+    fprintf(stderr, "Some non-contiguous arrays\n");
+    return -1; 
+  }
+  if ((PyArray_NDIM(Tvox) != 3) || (PyArray_DIM(Tvox, 2) != 4)) {
+    fprintf(stderr, "Batch computation requires affine transformations\n");
+    return -1; 
+  }
+  if ((_check_mode(mode, interp) < 0) || (mode >= HISTOGRAM_HASHED)) {
+    fprintf(stderr, "Batch computation requires dense histograms or moments\n");
+    return -1; 
+  }
+  K = PyArray_DIM(Tvox, 0); 
+  stride = 4*PyArray_DIM(Tvox, 1); 
+  if (mode == HISTOGRAM_MOMENTS) 
+    clampJ = 3; 
+  clampIJ = clampI*clampJ; 
+  if ((size_t)PyArray_SIZE(JH) != K*clampIJ) {
+    fprintf(stderr, "Histogram array has wrong size\n");
+    return -1; 
+  }
+  X = (int*)PyArray_DATA(XYZ); 
+  Y = X + N; 
+  Z = Y + N; 
+
+  /* Restrict to the draws of the current block */
+  size = _init_sampling(sampling, N, nsamples, seed, &stratum, &srng); 
+  if (stop > size)
+    stop = size; 
+  if (start < 0)
+    start = 0; 
+
+  /* Set interpolation method */ 
+  interpolate = _interpolation_method(interp, mode, &rand, &interp_params); 
+
+  /* Re-initialize joint histograms */ 
+  memset((void*)H, 0, K*clampIJ*sizeof(double));
+
+  /* 
+     Loop over blocks of source samples, each of which is transformed
+     by all transformations in turn (see joint_histogram())
+  */
+  dims[0] = dimJX; 
+  dims[1] = dimJY; 
+  dims[2] = dimJZ; 
+  lims[0] = (dimJX+1) << FIXED_SHIFT; 
+  lims[1] = (dimJY+1) << FIXED_SHIFT; 
+  lims[2] = (dimJZ+1) << FIXED_SHIFT; 
+  for (d=start; d<stop; d+=SAMPLE_BLOCK) {
+    nb = SPECIALIZE(_gather_block)(ib, xb, yb, zb, d, stop, sampling, N, 
+				   stratum, &srng, bufI, X, Y, Z); 
+    for (k=0, t=tvox; k<K; k++, t+=stride) {
+      if (fixed) 
+	inside = _transform_block_fixed(nx, ny, nz, wx, wy, wz, xb, yb, zb, 
+					tfix + k*stride, lims); 
+      else 
+	inside = transform(nx, ny, nz, wx, wy, wz, 
+			   xb, yb, zb, t, dims); 
+      for (b=0; b<nb; b++) {
+	rand.draw = d+b; 
+	if ((ib[b]>=0) && ((inside >> b) & 1) && 
+	    OCCUPIED(&O, nx[b], ny[b], nz[b])) 
+	  SPECIALIZE(_update_neighbors)(H + k*clampIJ, clampJ, ib[b], 
+					nx[b], ny[b], nz[b], 
+					wx[b], wy[b], wz[b], J, &L, 
+					interpolate, interp_params); 
+      }
+    }
+  } 
+
+  return 0; 
+}
+
+
+/* 
+   Update the Parzen window joint histogram H and its gradient G with
+   a source voxel of intensity i and homogeneous grid coordinates v,
+   given the per-axis trilinear weights (ax, ay, az) of its neighbors
+   at offsets (qx, qy, qz) in the padded target image J (see
+   joint_histogram_gradient() in joint_histogram.c).
+*/ 
+static inline void SPECIALIZE(_parzen_gradient)(double* H, 
+						double* G, 
+						unsigned int clampJ, 
+						int i, 
+						const TARGET_TYPE* J, 
+						const npy_intp* qx, 
+						const npy_intp* qy, 
+						const npy_intp* qz, 
+						const double* ax, 
+						const double* ay, 
+						const double* az, 
+						const double* v)
+{
+  const double sgn[2] = {-1.0, 1.0}; 
+  double S = 0, P = 0, dS[3] = {0, 0, 0}, dP[3] = {0, 0, 0}; 
+  double w, dw[3], jm, djm[3], pw[4], dpw[4], c, *g; 
+  int dx, dy, dz, a, b, k, j, j0; 
+  npy_intp q; 
+
+  /* Sum of weights and weighted sum of intensities of the unmasked
+     neighbors, and their derivatives along each axis */ 
+  for (dx=0; dx<2; dx++)
+    for (dy=0; dy<2; dy++)
+      for (dz=0; dz<2; dz++) {
+	j = LOAD_TARGET(J, qx[dx] + qy[dy] + qz[dz]); 
+	if (j<0) 
+	  continue; 
+	w = ax[dx]*ay[dy]*az[dz]; 
+	dw[0] = sgn[dx]*ay[dy]*az[dz]; 
+	dw[1] = sgn[dy]*ax[dx]*az[dz]; 
+	dw[2] = sgn[dz]*ax[dx]*ay[dy]; 
+	S += w; 
+	P += w*j; 
+	for (a=0; a<3; a++) {
+	  dS[a] += dw[a]; 
+	  dP[a] += dw[a]*j; 
+	}
+      }
+  if (S <= 0.0) 
+    return; 
+
+  /* Contributions S*pw[b] and their derivatives through S and jm */ 
+  jm = P/S; 
+  for (a=0; a<3; a++) 
+    djm[a] = (dP[a] - jm*dS[a])/S; 
+  j0 = _parzen_window(pw, dpw, jm); 
+  for (b=0; b<4; b++) {
+    q = i*clampJ + PARZEN_BIN(j0+b-1, clampJ); 
+    H[q] += S*pw[b]; 
+    g = G + 12*q; 
+    for (a=0; a<3; a++) {
+      c = dS[a]*pw[b] + S*dpw[b]*djm[a]; 
+      for (k=0; k<4; k++) 
+	g[4*a+k] += c*v[k]; 
+    }
+  }
+
+  return; 
+}
+
+
+static int SPECIALIZE(joint_histogram_gradient)(PyArrayObject* JH, 
+						PyArrayObject* JG, 
+						unsigned int clampI, 
+						unsigned int clampJ,  
+						const PyArrayObject* samples,
+						const PyArrayObject* XYZ,
+						const PyArrayObject* imJ_padded, 
+						const PyArrayObject* layout, 
+						const PyArrayObject* occupancy, 
+						const PyArrayObject* Tvox, 
+						long interp, 
+						int sampling, 
+						npy_intp nsamples, 
+						long seed, 
+						npy_intp start, 
+						npy_intp stop)
+{
+  const TARGET_TYPE* J=(TARGET_TYPE*)imJ_padded->data; 
+  size_t dimJX=imJ_padded->dimensions[0]-2;
+  size_t dimJY=imJ_padded->dimensions[1]-2; 
+  size_t dimJZ=imJ_padded->dimensions[2]-2;  
+  double *H = (double*)PyArray_DATA(JH);  
+  double *G = (double*)PyArray_DATA(JG);  
+  const double *tvox = (double*)PyArray_DATA(Tvox); 
+  const SOURCE_TYPE *bufI = (SOURCE_TYPE*)PyArray_DATA(samples); 
+  const int *X, *Y, *Z; 
+  npy_intp d, n, N = PyArray_SIZE(samples), size; 
+  double stratum = 1; 
+  philox_state srng; 
+  double ax[2], ay[2], az[2], v[4]; 
+  const double sgn[2] = {-1.0, 1.0}; 
+  double Tx, Ty, Tz, w, gx, gy, gz, *g; 
+  npy_intp qx[2], qy[2], qz[2]; 
+  int nx, ny, nz, dx, dy, dz, k; 
+  int i, j; 
+  target_layout L; 
+  target_occupancy O; 
+
+  /* Check assumptions regarding input arrays */ 
+  if ((_check_samples(samples, XYZ, 1) < 0) || 
+      (_init_layout(&L, layout, imJ_padded) < 0) || 
+      (_init_occupancy(&O, occupancy, imJ_padded) < 0)) 
+    return -1; 
+  if ( (!PyArray_ISCONTIGUOUS(imJ_padded)) || 
+       (!PyArray_ISCONTIGUOUS(JH)) ||
+       (!PyArray_ISCONTIGUOUS(JG)) ||
+       (!PyArray_ISCONTIGUOUS(Tvox)) ) {
+    fprintf(stderr, "Some non-contiguous arrays\n");
+    return -1; 
+  }
+  if (_check_transform(Tvox, 0) < 0) 
+    return -1; 
+  if (PyArray_DIM(Tvox, PyArray_NDIM(Tvox)-1) != 4) {
+    fprintf(stderr, "Gradient computation requires an affine transformation\n");
+    return -1; 
+  }
+  if ((interp != 0) && (interp != PARZEN_INTERPOLATION)) {
+    fprintf(stderr, "Gradient computation requires PV or Parzen window interpolation\n");
+    return -1; 
+  }
+  if ((size_t)PyArray_SIZE(JG) != 12*clampI*clampJ) {
+    fprintf(stderr, "Gradient array has wrong size\n");
+    return -1; 
+  }
+  X = (int*)PyArray_DATA(XYZ); 
+  Y = X + N; 
+  Z = Y + N; 
+
+  /* Restrict to the draws of the current block */
+  size = _init_sampling(sampling, N, nsamples, seed, &stratum, &srng); 
+  if (stop > size)
+    stop = size; 
+  if (start < 0)
+    start = 0; 
+
+  /* Re-initialize joint histogram and its gradient */ 
+  memset((void*)H, 0, clampI*clampJ*sizeof(double));
+  memset((void*)G, 0, 12*clampI*clampJ*sizeof(double));
+
+  /* Looop over source samples */
+  v[3] = 1.0; 
+  for (d=start; d<stop; d++) {
+    n = _draw_sample(d, sampling, N, stratum, &srng); 
+    i = LOAD_SOURCE(bufI, n); 
+    v[0] = (double)X[n]; 
+    v[1] = (double)Y[n]; 
+    v[2] = (double)Z[n]; 
+
+    /* Transformed grid coordinates of current sample */ 
+    Tx = tvox[0]*v[0] + tvox[1]*v[1] + tvox[2]*v[2] + tvox[3]; 
+    Ty = tvox[4]*v[0] + tvox[5]*v[1] + tvox[6]*v[2] + tvox[7]; 
+    Tz = tvox[8]*v[0] + tvox[9]*v[1] + tvox[10]*v[2] + tvox[11]; 
+
+    if ((i>=0) && 
+	(Tx>-1) && (Tx<dimJX) && 
+	(Ty>-1) && (Ty<dimJY) && 
+	(Tz>-1) && (Tz<dimJZ)) {
+
+      nx = (int)(Tx+1);
+      ny = (int)(Ty+1);
+      nz = (int)(Tz+1);
+      if (!OCCUPIED(&O, nx, ny, nz)) 
+	continue; 
+      ax[0] = nx - Tx; 
+      ay[0] = ny - Ty; 
+      az[0] = nz - Tz; 
+      ax[1] = 1 - ax[0]; 
+      ay[1] = 1 - ay[0]; 
+      az[1] = 1 - az[0]; 
+      qx[0] = L.x[nx]; 
+      qx[1] = L.x[nx+1]; 
+      qy[0] = L.y[ny]; 
+      qy[1] = L.y[ny+1]; 
+      qz[0] = L.z[nz]; 
+      qz[1] = L.z[nz+1]; 
+      if (interp == PARZEN_INTERPOLATION) {
+	SPECIALIZE(_parzen_gradient)(H, G, clampJ, i, J, qx, qy, qz, 
+				     ax, ay, az, v); 
+	continue; 
+      }
+
+      /* Same neighbor ordering as in joint_histogram() */
+      for (dx=0; dx<2; dx++)
+	for (dy=0; dy<2; dy++)
+	  for (dz=0; dz<2; dz++) {
+	    j = LOAD_TARGET(J, qx[dx] + qy[dy] + qz[dz]); 
+	    if (j<0) 
+	      continue; 
+	    w = ay[dy]*az[dz]; 
+	    H[i*clampJ+j] += ax[dx]*w; 
+	    gx = sgn[dx]*w; 
+	    gy = sgn[dy]*ax[dx]*az[dz]; 
+	    gz = sgn[dz]*ax[dx]*ay[dy]; 
+	    g = G + 12*(i*clampJ+j); 
+	    for (k=0; k<4; k++) {
+	      g[k] += gx*v[k]; 
+	      g[k+4] += gy*v[k]; 
+	      g[k+8] += gz*v[k]; 
+	    }
+	  }
+    }
+
+  } /* End of loop over samples */ 
+
+  return 0; 
+}
+
+
+#undef APPEND_NEIGHBOR
+#undef SOURCE_TYPE
+#undef TARGET_TYPE
+#undef LOAD_SOURCE
+#undef LOAD_TARGET
+#undef TYPES
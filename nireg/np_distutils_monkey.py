@@ -12,7 +12,7 @@ def generate_a_pyrex_source(self, base, ext_name, source, extension):
 
     Uses Cython instead of Pyrex.
 
-    Assumes Cython is present
+    Requires Cython: the generated C source is not shipped.
     '''
     if self.inplace:
         target_dir = dirname(base)
@@ -21,7 +21,11 @@ def generate_a_pyrex_source(self, base, ext_name, source, extension):
     target_file = pjoin(target_dir, ext_name + '.c')
     depends = [source] + extension.depends
     if self.force or newer_group(depends, target_file, 'newer'):
-        import Cython.Compiler.Main
+        try:
+            import Cython.Compiler.Main
+        except ImportError:
+            raise DistutilsError("Cython >= 0.20 is required to build %r"
+                                 % source)
         log.info("cythonc:> %s" % (target_file))
         self.mkpath(target_dir)
         options = Cython.Compiler.Main.CompilationOptions(
@@ -0,0 +1,63 @@
+#include "philox_prng.h"
+
+#include <stdint.h>
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+
+void philox_seed(unsigned long seed, unsigned int stream, philox_state* rng)
+{
+  uint64_t s = (uint64_t)seed; 
+
+  rng->key[0] = (unsigned int)(s & 0xffffffffu); 
+  rng->key[1] = (unsigned int)(s >> 32); 
+  rng->stream = stream; 
+
+  return; 
+}
+
+
+/* 
+   Encrypt the counter (n, stream, 0) with the generator key, and
+   return the first two output words.
+*/
+static void _philox4x32(uint32_t* out0, uint32_t* out1, 
+			const philox_state* rng, uint64_t n)
+{
+  uint32_t c0 = (uint32_t)n, c1 = (uint32_t)(n >> 32); 
+  uint32_t c2 = rng->stream, c3 = 0; 
+  uint32_t k0 = rng->key[0], k1 = rng->key[1]; 
+  uint64_t p0, p1; 
+  int r; 
+
+  for (r=0; r<PHILOX_ROUNDS; r++) {
+    p0 = (uint64_t)PHILOX_M0 * c0; 
+    p1 = (uint64_t)PHILOX_M1 * c2; 
+    c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0; 
+    c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1; 
+    c1 = (uint32_t)p1; 
+    c3 = (uint32_t)p0; 
+    k0 += PHILOX_W0; 
+    k1 += PHILOX_W1; 
+  }
+
+  *out0 = c0; 
+  *out1 = c1; 
+  
+  return; 
+}
+
+
+/* Uniform double in [0,1) with 53 random bits */
+double philox_double(const philox_state* rng, unsigned long long n)
+{
+  uint32_t a, b; 
+
+  _philox4x32(&a, &b, rng, (uint64_t)n); 
+
+  return ((a >> 5) * 67108864.0 + (b >> 6)) * (1.0 / 9007199254740992.0); 
+}
@@ -0,0 +1,35 @@
+#ifndef PHILOX_PRNG
+#define PHILOX_PRNG
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /*
+    Philox4x32-10 counter-based generator:
+
+    J.K. Salmon, M.A. Moraes, R.O. Dror, D.E. Shaw, Parallel random
+    numbers: as easy as 1, 2, 3, Proceedings of the International
+    Conference for High Performance Computing, Networking, Storage
+    and Analysis (SC'11), 2011, DOI: 10.1145/2063384.2063405.
+
+    The n-th number of a stream is a function of the seed, the stream
+    index and n only. Any range of a stream may thus be drawn
+    independently, e.g. from several threads, with the same outcome
+    as a sequential draw.
+   */
+
+  typedef struct {
+    unsigned int key[2]; 
+    unsigned int stream; 
+  } philox_state;
+
+  extern void philox_seed(unsigned long seed, unsigned int stream, 
+			  philox_state* rng);
+  extern double philox_double(const philox_state* rng, unsigned long long n); 
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
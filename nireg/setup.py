@@ -17,9 +17,11 @@ def configuration(parent_package='', top_path=None):
         '_register',
         sources=['_register.pyx',
                  'joint_histogram.c',
-                 'wichmann_prng.c',
+                 'similarity_measures.c',
+                 'philox_prng.c',
                  'cubic_spline.c',
                  'polyaffine.c'])
+    config.add_subpackage('benchmarks')
     config.add_subpackage('externals')
     config.add_subpackage('slicetiming')
     config.add_subpackage('testing')
@@ -0,0 +1,535 @@
+#include "similarity_measures.h"
+#include "joint_histogram.h"
+
+#include <math.h>
+#include <float.h>
+#include <stdlib.h>
+
+#define NONZERO(a) ((a) > DBL_MIN ? (a) : DBL_MIN)
+#define XLOGX(a) ((a) > 0 ? (a)*log(a) : 0)
+
+/*
+   Number of columns processed at once in column-wise passes: these
+   walk the histogram row by row over blocks of consecutive columns,
+   so that each cache line is loaded once in total while column
+   accumulators stay in registers.
+*/
+#define COLUMN_BLOCK 8
+
+
+static int _check_histogram(const PyArrayObject* H)
+{
+  if ((PyArray_TYPE(H) != NPY_DOUBLE) ||
+      (!PyArray_ISCONTIGUOUS(H)) ||
+      (PyArray_NDIM(H) != 2)) {
+    fprintf(stderr, "Joint histogram should be a double C-contiguous two-dimensional array\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+/* sum_j c(j) log c(j), where c(j) = sum_i H(i,j) */
+static double _column_entropy_sum(const double* H, size_t dimI, size_t dimJ)
+{
+  double c[COLUMN_BLOCK];
+  const double *buf;
+  double res = 0;
+  size_t i, j, k, nk;
+
+  for (j=0; j<dimJ; j+=COLUMN_BLOCK) {
+    nk = (dimJ-j < COLUMN_BLOCK) ? dimJ-j : COLUMN_BLOCK;
+    for (k=0; k<nk; k++)
+      c[k] = 0;
+    for (i=0, buf=H+j; i<dimI; i++, buf+=dimJ)
+      for (k=0; k<nk; k++)
+	c[k] += buf[k];
+    for (k=0; k<nk; k++)
+      res += XLOGX(c[k]);
+  }
+
+  return res;
+}
+
+
+/*
+   Sums of H(i,j) log H(i,j), r(i) log r(i) and c(j) log c(j), where r
+   and c are the marginal histograms, and total mass n.
+*/
+static void _entropy_sums(double* hIJ, double* hI, double* hJ, double* n,
+			  const PyArrayObject* JH)
+{
+  const double *H = (const double*)PyArray_DATA(JH), *buf = H;
+  size_t dimI = PyArray_DIM(JH, 0), dimJ = PyArray_DIM(JH, 1);
+  size_t i, j;
+  double r;
+
+  *hIJ = *hI = *n = 0;
+  for (i=0; i<dimI; i++) {
+    r = 0;
+    for (j=0; j<dimJ; j++, buf++) {
+      r += *buf;
+      *hIJ += XLOGX(*buf);
+    }
+    *hI += XLOGX(r);
+    *n += r;
+  }
+  *hJ = _column_entropy_sum(H, dimI, dimJ);
+
+  return;
+}
+
+
+int mutual_information(double* res, double* npts, const PyArrayObject* H)
+{
+  double hIJ, hI, hJ, n;
+
+  if (_check_histogram(H) < 0)
+    return -1;
+  _entropy_sums(&hIJ, &hI, &hJ, &n, H);
+  *npts = n;
+  *res = (n > 0) ? hIJ + n*log(n) - hI - hJ : 0;
+
+  return 0;
+}
+
+
+int normalized_mutual_information(double* res, double* npts, const PyArrayObject* H)
+{
+  double hIJ, hI, hJ, n, logn;
+
+  if (_check_histogram(H) < 0)
+    return -1;
+  _entropy_sums(&hIJ, &hI, &hJ, &n, H);
+  *npts = n;
+  if (n <= 0) {
+    *res = 0;
+    return 0;
+  }
+
+  /* Entropies of the normalized histograms, e.g. -sum p log p = log n
+     - sum h log h / n */
+  logn = log(n);
+  hIJ = logn - hIJ/n;
+  hI = logn - hI/n;
+  hJ = logn - hJ/n;
+  *res = (hI + hJ) / NONZERO(hIJ);
+
+  return 0;
+}
+
+
+int correlation_coefficient(double* res, double* npts, const PyArrayObject* JH)
+{
+  const double *buf = (const double*)PyArray_DATA(JH);
+  size_t dimI, dimJ, i, j;
+  double n=0, si=0, sj=0, sii=0, sjj=0, sij=0;
+  double r, rj, rjj, h, mI, mJ, vI, vJ, cIJ, tmp;
+
+  if (_check_histogram(JH) < 0)
+    return -1;
+  dimI = PyArray_DIM(JH, 0);
+  dimJ = PyArray_DIM(JH, 1);
+
+  /* First and second order moments, accumulated row by row */
+  for (i=0; i<dimI; i++) {
+    r = rj = rjj = 0;
+    for (j=0; j<dimJ; j++, buf++) {
+      h = *buf;
+      r += h;
+      rj += h*j;
+      rjj += h*j*j;
+    }
+    n += r;
+    si += r*i;
+    sii += r*i*i;
+    sj += rj;
+    sjj += rjj;
+    sij += rj*i;
+  }
+
+  *npts = n;
+  n = NONZERO(n);
+  mI = sj/n;
+  mJ = si/n;
+  vI = sjj/n - mI*mI;
+  vJ = sii/n - mJ*mJ;
+  cIJ = sij/n - mI*mJ;
+  tmp = cIJ/NONZERO(sqrt(vI*vJ));
+  *res = tmp*tmp;
+
+  return 0;
+}
+
+
+/*
+   Accumulate the within-class variance of Y given X, where
+   (n, s1, s2) are the mass, first and second order moments of Y in
+   a class of X.
+*/
+#define ACCUMULATE_CLASS(n, s1, s2)		\
+  tmp = NONZERO(n);				\
+  m = (s1)/tmp;					\
+  mean_v += (n)*((s2)/tmp - m*m);		\
+  N += (n);					\
+  S1 += (s1);					\
+  S2 += (s2)
+
+/*
+   Correlation ratio given the total mass N and moments S1, S2 of Y,
+   and the accumulated within-class variance mean_v.
+*/
+static double _correlation_ratio(double* npts, double N, double S1,
+				 double S2, double mean_v)
+{
+  double mY, vY, tmp;
+
+  *npts = N;
+  tmp = NONZERO(N);
+  mY = S1/tmp;
+  vY = S2/tmp - mY*mY;
+  mean_v /= tmp;
+  return 1 - mean_v/NONZERO(vY);
+}
+
+int correlation_ratio(double* res, double* npts, const PyArrayObject* JH, int transpose)
+{
+  const double *H = (const double*)PyArray_DATA(JH), *buf;
+  size_t dimI, dimJ, i, j, k, nk;
+  double n[COLUMN_BLOCK], s1[COLUMN_BLOCK], s2[COLUMN_BLOCK];
+  double N=0, S1=0, S2=0, mean_v=0;
+  double h, r, rj, rjj, m, tmp;
+
+  if (_check_histogram(JH) < 0)
+    return -1;
+  dimI = PyArray_DIM(JH, 0);
+  dimJ = PyArray_DIM(JH, 1);
+
+  if (!transpose) {
+    /* Rows are the classes, and columns the response */
+    for (i=0, buf=H; i<dimI; i++) {
+      r = rj = rjj = 0;
+      for (j=0; j<dimJ; j++, buf++) {
+	h = *buf;
+	r += h;
+	rj += h*j;
+	rjj += h*j*j;
+      }
+      ACCUMULATE_CLASS(r, rj, rjj);
+    }
+  }
+  else {
+    /* Columns are the classes, and rows the response */
+    for (j=0; j<dimJ; j+=COLUMN_BLOCK) {
+      nk = (dimJ-j < COLUMN_BLOCK) ? dimJ-j : COLUMN_BLOCK;
+      for (k=0; k<nk; k++)
+	n[k] = s1[k] = s2[k] = 0;
+      for (i=0, buf=H+j; i<dimI; i++, buf+=dimJ)
+	for (k=0; k<nk; k++) {
+	  h = buf[k];
+	  n[k] += h;
+	  s1[k] += h*i;
+	  s2[k] += h*i*i;
+	}
+      for (k=0; k<nk; k++) {
+	ACCUMULATE_CLASS(n[k], s1[k], s2[k]);
+      }
+    }
+  }
+
+  *res = _correlation_ratio(npts, N, S1, S2, mean_v);
+
+  return 0;
+}
+
+
+int weighted_sum(double* res, double* npts, const PyArrayObject* JH, const PyArrayObject* JL)
+{
+  const double *H = (const double*)PyArray_DATA(JH);
+  const double *L = (const double*)PyArray_DATA(JL);
+  npy_intp k, size;
+  double s=0, n=0;
+
+  if ((_check_histogram(JH) < 0) || (_check_histogram(JL) < 0))
+    return -1;
+  size = PyArray_SIZE(JH);
+  if (PyArray_SIZE(JL) != size) {
+    fprintf(stderr, "Loss array has wrong size\n");
+    return -1;
+  }
+  for (k=0; k<size; k++) {
+    n += H[k];
+    s += H[k]*L[k];
+  }
+  *npts = n;
+  *res = s;
+
+  return 0;
+}
+
+
+/*
+   Hashed histograms (see joint_histogram.h): only their occupied
+   rows are visited. _hashed_entry() returns whether the row buf is
+   occupied by an entry (i, j) within clampI x clampJ, other entries
+   being ignored.
+*/
+static inline int _hashed_entry(size_t* i, size_t* j, const double* buf,
+				unsigned int clampI, unsigned int clampJ)
+{
+  size_t key;
+
+  if (buf[0] <= 0)
+    return 0;
+  key = (size_t)buf[0] - 1;
+  *i = key / HASHED_KEY_BASE;
+  *j = key % HASHED_KEY_BASE;
+  return (*i < clampI) && (*j < clampJ);
+}
+
+static int _check_hashed(const PyArrayObject* T)
+{
+  if ((PyArray_TYPE(T) != NPY_DOUBLE) ||
+      (!PyArray_ISCONTIGUOUS(T)) ||
+      (PyArray_NDIM(T) != 2) ||
+      (PyArray_DIM(T, 1) != 2) ||
+      (PyArray_DIM(T, 0) < 2)) {
+    fprintf(stderr, "Hashed histogram should be a double C-contiguous array of shape (C+1, 2)\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+   Hashed version of _entropy_sums(), where the marginal histograms
+   are accumulated in temporary arrays.
+*/
+static int _hashed_entropy_sums(double* hIJ, double* hI, double* hJ,
+				double* n, const PyArrayObject* T,
+				unsigned int clampI, unsigned int clampJ)
+{
+  const double *buf = (const double*)PyArray_DATA(T);
+  double *r, *c;
+  size_t s, C, i, j;
+
+  if (_check_hashed(T) < 0)
+    return -1;
+  C = PyArray_DIM(T, 0) - 1;
+  r = (double*)calloc((size_t)clampI + clampJ, sizeof(double));
+  if (r == NULL) {
+    fprintf(stderr, "Cannot allocate marginal histograms\n");
+    return -1;
+  }
+  c = r + clampI;
+
+  *hIJ = *hI = *hJ = *n = 0;
+  for (s=0; s<C; s++, buf+=2) {
+    if (!_hashed_entry(&i, &j, buf, clampI, clampJ))
+      continue;
+    *hIJ += XLOGX(buf[1]);
+    r[i] += buf[1];
+    c[j] += buf[1];
+    *n += buf[1];
+  }
+  for (i=0; i<clampI; i++)
+    *hI += XLOGX(r[i]);
+  for (j=0; j<clampJ; j++)
+    *hJ += XLOGX(c[j]);
+  free(r);
+
+  return 0;
+}
+
+
+int hashed_mutual_information(double* res, double* npts,
+			      const PyArrayObject* T,
+			      unsigned int clampI, unsigned int clampJ)
+{
+  double hIJ, hI, hJ, n;
+
+  if (_hashed_entropy_sums(&hIJ, &hI, &hJ, &n, T, clampI, clampJ) < 0)
+    return -1;
+  *npts = n;
+  *res = (n > 0) ? hIJ + n*log(n) - hI - hJ : 0;
+
+  return 0;
+}
+
+
+int hashed_normalized_mutual_information(double* res, double* npts,
+					 const PyArrayObject* T,
+					 unsigned int clampI,
+					 unsigned int clampJ)
+{
+  double hIJ, hI, hJ, n, logn;
+
+  if (_hashed_entropy_sums(&hIJ, &hI, &hJ, &n, T, clampI, clampJ) < 0)
+    return -1;
+  *npts = n;
+  if (n <= 0) {
+    *res = 0;
+    return 0;
+  }
+  logn = log(n);
+  hIJ = logn - hIJ/n;
+  hI = logn - hI/n;
+  hJ = logn - hJ/n;
+  *res = (hI + hJ) / NONZERO(hIJ);
+
+  return 0;
+}
+
+
+int hashed_correlation_ratio(double* res, double* npts,
+			     const PyArrayObject* T,
+			     unsigned int clampI, unsigned int clampJ,
+			     int transpose)
+{
+  const double *buf = (const double*)PyArray_DATA(T);
+  double *M, h, y;
+  size_t s, C, i, j, x;
+  size_t dimX = transpose ? clampJ : clampI;
+  double N=0, S1=0, S2=0, mean_v=0;
+  double m, tmp;
+
+  if (_check_hashed(T) < 0)
+    return -1;
+  C = PyArray_DIM(T, 0) - 1;
+  M = (double*)calloc(3*dimX, sizeof(double));
+  if (M == NULL) {
+    fprintf(stderr, "Cannot allocate class moments\n");
+    return -1;
+  }
+
+  /* Moments of the response given each class */
+  for (s=0; s<C; s++, buf+=2) {
+    if (!_hashed_entry(&i, &j, buf, clampI, clampJ))
+      continue;
+    h = buf[1];
+    x = 3*(transpose ? j : i);
+    y = (double)(transpose ? i : j);
+    M[x] += h;
+    M[x+1] += h*y;
+    M[x+2] += h*y*y;
+  }
+  for (x=0; x<3*dimX; x+=3) {
+    ACCUMULATE_CLASS(M[x], M[x+1], M[x+2]);
+  }
+  free(M);
+  *res = _correlation_ratio(npts, N, S1, S2, mean_v);
+
+  return 0;
+}
+
+
+/*
+   Count histograms (see joint_histogram.h): entries and marginals are
+   integers, so that n log n is read from a table for counts below
+   XLOGX_TABLE_SIZE, which covers nearly all entries of large
+   histograms. The table is filled on first use; similarity routines
+   are called from Python with the GIL held.
+*/
+#define XLOGX_TABLE_SIZE 4096
+
+static double _xlogx_table[XLOGX_TABLE_SIZE];
+static int _xlogx_ready = 0;
+
+static inline double _count_xlogx(npy_uint64 n)
+{
+  if (n < XLOGX_TABLE_SIZE)
+    return _xlogx_table[n];
+  return (double)n*log((double)n);
+}
+
+static int _check_counts(const PyArrayObject* H)
+{
+  size_t n;
+
+  if ((PyArray_TYPE(H) != NPY_UINT32) ||
+      (!PyArray_ISCONTIGUOUS(H)) ||
+      (PyArray_NDIM(H) != 2)) {
+    fprintf(stderr, "Count histogram should be a uint32 C-contiguous two-dimensional array\n");
+    return -1;
+  }
+  if (!_xlogx_ready) {
+    _xlogx_table[0] = 0;
+    for (n=1; n<XLOGX_TABLE_SIZE; n++)
+      _xlogx_table[n] = (double)n*log((double)n);
+    _xlogx_ready = 1;
+  }
+  return 0;
+}
+
+
+/* Count version of _entropy_sums() */
+static void _counts_entropy_sums(double* hIJ, double* hI, double* hJ,
+				 double* n, const PyArrayObject* JH)
+{
+  const npy_uint32 *H = (const npy_uint32*)PyArray_DATA(JH), *buf;
+  size_t dimI = PyArray_DIM(JH, 0), dimJ = PyArray_DIM(JH, 1);
+  size_t i, j, k, nk;
+  npy_uint64 r, c[COLUMN_BLOCK], total = 0;
+
+  *hIJ = *hI = *hJ = 0;
+  for (i=0, buf=H; i<dimI; i++) {
+    r = 0;
+    for (j=0; j<dimJ; j++, buf++) {
+      r += *buf;
+      *hIJ += _count_xlogx(*buf);
+    }
+    *hI += _count_xlogx(r);
+    total += r;
+  }
+  for (j=0; j<dimJ; j+=COLUMN_BLOCK) {
+    nk = (dimJ-j < COLUMN_BLOCK) ? dimJ-j : COLUMN_BLOCK;
+    for (k=0; k<nk; k++)
+      c[k] = 0;
+    for (i=0, buf=H+j; i<dimI; i++, buf+=dimJ)
+      for (k=0; k<nk; k++)
+	c[k] += buf[k];
+    for (k=0; k<nk; k++)
+      *hJ += _count_xlogx(c[k]);
+  }
+  *n = (double)total;
+
+  return;
+}
+
+
+int counts_mutual_information(double* res, double* npts,
+			      const PyArrayObject* H)
+{
+  double hIJ, hI, hJ, n;
+
+  if (_check_counts(H) < 0)
+    return -1;
+  _counts_entropy_sums(&hIJ, &hI, &hJ, &n, H);
+  *npts = n;
+  *res = (n > 0) ? hIJ + n*log(n) - hI - hJ : 0;
+
+  return 0;
+}
+
+
+int counts_normalized_mutual_information(double* res, double* npts,
+					 const PyArrayObject* H)
+{
+  double hIJ, hI, hJ, n, logn;
+
+  if (_check_counts(H) < 0)
+    return -1;
+  _counts_entropy_sums(&hIJ, &hI, &hJ, &n, H);
+  *npts = n;
+  if (n <= 0) {
+    *res = 0;
+    return 0;
+  }
+  logn = log(n);
+  hIJ = logn - hIJ/n;
+  hI = logn - hI/n;
+  hJ = logn - hJ/n;
+  *res = (hI + hJ) / NONZERO(hIJ);
+
+  return 0;
+}
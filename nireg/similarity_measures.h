@@ -0,0 +1,98 @@
+#ifndef SIMILARITY_MEASURES
+#define SIMILARITY_MEASURES
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <Python.h>
+
+/*
+ * Use extension numpy symbol table
+ */
+#define NO_IMPORT_ARRAY
+#include "_register.h"
+
+#include <numpy/arrayobject.h>
+
+  /*
+     Similarity measures computed from a joint histogram H, assumed
+     double C-contiguous with source intensities as row indices and
+     target intensities as column indices. Each function makes one or
+     two passes over H and allocates no memory. The total histogram
+     mass is returned in npts. Returns -1 if H is not a double
+     C-contiguous two-dimensional array, 0 otherwise.
+
+     mutual_information: sum_ij H(i,j) log[H(i,j) n / (H(i) H(j))],
+     i.e. the mutual information times n, where n is the histogram
+     mass and H(i), H(j) are the marginal histograms.
+
+     normalized_mutual_information: [h(I) + h(J)] / h(I,J) where h
+     denotes entropies.
+
+     correlation_coefficient: squared correlation coefficient between
+     the row and column indices.
+
+     correlation_ratio: correlation ratio of the column index (the
+     response) given the row index (the predictor), or conversely if
+     transpose is non-zero.
+
+     weighted_sum: sum_ij H(i,j) L(i,j), where L has the same shape
+     as H and is C-contiguous.
+  */
+  extern int mutual_information(double* res, double* npts,
+				const PyArrayObject* H);
+  extern int normalized_mutual_information(double* res, double* npts,
+					   const PyArrayObject* H);
+  extern int correlation_coefficient(double* res, double* npts,
+				     const PyArrayObject* H);
+  extern int correlation_ratio(double* res, double* npts,
+			       const PyArrayObject* H,
+			       int transpose);
+  extern int weighted_sum(double* res, double* npts,
+			  const PyArrayObject* H,
+			  const PyArrayObject* L);
+
+  /*
+     Versions of the above for a hashed histogram T of the non-empty
+     entries of a clampI x clampJ joint histogram, see
+     joint_histogram.h. They only visit the rows of T, and allocate
+     temporary arrays of the size of the marginal histograms. Returns
+     -1 if T is not a hashed histogram or allocation fails, 0
+     otherwise.
+  */
+  extern int hashed_mutual_information(double* res, double* npts,
+				       const PyArrayObject* T,
+				       unsigned int clampI,
+				       unsigned int clampJ);
+  extern int hashed_normalized_mutual_information(double* res,
+						  double* npts,
+						  const PyArrayObject* T,
+						  unsigned int clampI,
+						  unsigned int clampJ);
+  extern int hashed_correlation_ratio(double* res, double* npts,
+				      const PyArrayObject* T,
+				      unsigned int clampI,
+				      unsigned int clampJ,
+				      int transpose);
+
+  /*
+     Versions of mutual_information and normalized_mutual_information
+     for a count histogram H, i.e. a uint32 C-contiguous joint
+     histogram as accumulated in HISTOGRAM_COUNTS mode, see
+     joint_histogram.h. Marginals are summed as integers and n log n
+     terms are looked up in a table. Returns -1 if H is not such an
+     array, 0 otherwise.
+  */
+  extern int counts_mutual_information(double* res, double* npts,
+				       const PyArrayObject* H);
+  extern int counts_normalized_mutual_information(double* res,
+						  double* npts,
+						  const PyArrayObject* H);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,4 +1,5 @@
-from ._register import _L1_moments
+from ._register import (_L1_moments, _L1_moments_rows, _similarity,
+                        _hashed_similarity, _counts_similarity)
 
 import numpy as np
 from scipy.ndimage import gaussian_filter
@@ -11,6 +12,31 @@ OVERLAP_MIN = 0.01
 nonzero = lambda x: np.maximum(x, TINY)
 
 
+def _native(H, measure, L=None):
+    """
+    Evaluate a similarity statistic from the joint histogram `H` using
+    the C routines, see `_register._similarity`.
+    """
+    return _similarity(np.ascontiguousarray(H, dtype='double'), measure, L)
+
+
+def _native_hashed(T, measure, bins):
+    """
+    Evaluate a similarity statistic from the hashed histogram `T` of a
+    joint histogram of shape `bins`, see
+    `_register._hashed_similarity`.
+    """
+    return _hashed_similarity(T, measure, bins)
+
+
+def _native_counts(C, measure):
+    """
+    Evaluate a similarity statistic from the uint32 count histogram
+    `C`, see `_register._counts_similarity`.
+    """
+    return _counts_similarity(C, measure)
+
+
 def correlation2loglikelihood(rho2, npts, total_npts):
     """Re-normalize correlation.
 
@@ -45,6 +71,16 @@ def correlation2loglikelihood(rho2, npts, total_npts):
     return -.5 * tmp * np.log(nonzero(1 - rho2))
 
 
+def correlation2loglikelihood_gradient(rho2, g, npts, total_npts):
+    """Derivative of `correlation2loglikelihood` with respect to the
+    joint histogram, given the derivative `g` of the squared
+    correlation `rho2` and the number of points `npts`, which is the
+    histogram sum.
+    """
+    tmp = nonzero(1 - rho2)
+    return (-.5 * np.log(tmp) + .5 * npts * g / tmp) / total_npts
+
+
 def dist2loss(q, qI=None, qJ=None):
     """
     Convert a joint distribution model q(i,j) into a pointwise loss:
@@ -69,10 +105,33 @@ def dist2loss(q, qI=None, qJ=None):
 class SimilarityMeasure(object):
     """
     Template class
+
+    Subclasses may implement a ``gradient`` method returning the
+    derivative of the similarity with respect to each joint histogram
+    entry, which enables analytic gradient computation in histogram
+    registration.
+
+    Built-in measures are evaluated by C routines making one or two
+    passes over the joint histogram, rather than through the generic
+    ``loss`` based computation, which involves several temporary
+    arrays of the size of the histogram.
+
+    Measures that only depend on the moments of the target intensity
+    given the source intensity may implement a ``from_moments``
+    method taking a (shape[0], 3) array of such moments of order 0, 1
+    and 2 instead of the joint histogram.
+
+    Measures may also implement a ``from_hashed`` method taking a
+    hashed histogram of the non-empty joint histogram entries (see
+    `_register._hashed_histogram`), whose cost scales with the number
+    of such entries rather than with the number of bins.
+
+    Likewise, a ``from_counts`` method takes a uint32 joint histogram
+    of random interpolation draws, as accumulated by
+    `_register._joint_histogram`, to be multiplied by `scale`.
     """
     def __init__(self, shape, total_npoints, renormalize=False, dist=None):
         self.shape = shape
-        self.J, self.I = np.indices(shape)
         self.renormalize = renormalize
         if dist is None:
             self.dist = None
@@ -80,6 +139,16 @@ class SimilarityMeasure(object):
             self.dist = dist.copy()
         self.total_npoints = nonzero(float(total_npoints))
 
+    def _get_indices(self):
+        # Index arrays are only created on demand, as they have the
+        # size of the joint histogram
+        if not hasattr(self, '_indices'):
+            self._indices = np.indices(self.shape)
+        return self._indices
+
+    I = property(lambda self: self._get_indices()[1])
+    J = property(lambda self: self._get_indices()[0])
+
     def loss(self, H):
         return np.zeros(H.shape)
 
@@ -98,6 +167,19 @@ class SimilarityMeasure(object):
             total_loss /= nonzero(self.npoints(H))
         return -total_loss
 
+    def _loss_gradient(self, H):
+        """
+        Derivative of the similarity with respect to H for measures
+        whose loss does not vary with H to first order, namely when
+        the loss is either fixed or the negative log-likelihood of the
+        maximum likelihood distribution model given H.
+        """
+        L = self.loss(H)
+        if self.renormalize:
+            return -L / self.total_npoints
+        npts = nonzero(self.npoints(H))
+        return (np.sum(H * L) / npts - L) / npts
+
 
 class SupervisedLikelihoodRatio(SimilarityMeasure):
     """
@@ -112,6 +194,15 @@ class SupervisedLikelihoodRatio(SimilarityMeasure):
             self.L = dist2loss(self.dist)
         return self.L
 
+    def __call__(self, H):
+        total_loss, npts = _native(H, 'sum', self.loss(H))
+        if self.renormalize:
+            return -total_loss / self.total_npoints
+        return -total_loss / nonzero(npts)
+
+    def gradient(self, H):
+        return self._loss_gradient(H)
+
 
 class MutualInformation(SimilarityMeasure):
     """
@@ -120,12 +211,49 @@ class MutualInformation(SimilarityMeasure):
     def loss(self, H):
         return dist2loss(H / nonzero(self.npoints(H)))
 
+    def __call__(self, H):
+        mi, npts = _native(H, 'mi')
+        if self.renormalize:
+            return mi / self.total_npoints
+        return mi / nonzero(npts)
+
+    def from_hashed(self, T):
+        mi, npts = _native_hashed(T, 'mi', self.shape)
+        if self.renormalize:
+            return mi / self.total_npoints
+        return mi / nonzero(npts)
+
+    def from_counts(self, C, scale=1):
+        mi, npts = _native_counts(C, 'mi')
+        if self.renormalize:
+            return scale * mi / self.total_npoints
+        return mi / nonzero(npts)
+
+    def gradient(self, H):
+        """
+        Derivative of the mutual information with respect to H. Empty
+        histogram entries, where the derivative is infinite, are
+        assigned zero derivative.
+        """
+        g = self._loss_gradient(H)
+        g[H <= 0] = 0
+        return g
 
 
 class ParzenMutualInformation(MutualInformation):
     """
     Use Parzen windowing to estimate the distribution model
+
+    The joint histogram is smoothed at each evaluation. Parzen window
+    interpolation (see ``joint_histogram.c``) instead smoothes the
+    histogram while it is accumulated, in which case 'mi' should be
+    used.
     """
+    __call__ = SimilarityMeasure.__call__
+    from_hashed = None
+    from_counts = None
+    gradient = None
+
     def loss(self, H):
         if not hasattr(self, 'sigma'):
             self.sigma = SIGMA_FACTOR * np.array(H.shape)
@@ -140,6 +268,11 @@ class DiscreteParzenMutualInformation(MutualInformation):
     Use Parzen windowing in the discrete case to estimate the
     distribution model
     """
+    __call__ = SimilarityMeasure.__call__
+    from_hashed = None
+    from_counts = None
+    gradient = None
+
     def loss(self, H):
         if not hasattr(self, 'sigma'):
             self.sigma = SIGMA_FACTOR * np.array(H.shape)
@@ -162,14 +295,36 @@ class NormalizedMutualInformation(SimilarityMeasure):
     Studholme et al, Pattern Recognition, 1998.
     """
     def __call__(self, H):
-        H = H / nonzero(self.npoints(H))
-        hI = H.sum(0)
-        hJ = H.sum(1)
-        entIJ = -np.sum(H * np.log(nonzero(H)))
-        entI = -np.sum(hI * np.log(nonzero(hI)))
-        entJ = -np.sum(hJ * np.log(nonzero(hJ)))
-        #return 2 * (1 - entIJ / nonzero(entI + entJ))
-        return (entI + entJ) / nonzero(entIJ)
+        return _native(H, 'nmi')[0]
+
+    def from_hashed(self, T):
+        return _native_hashed(T, 'nmi', self.shape)[0]
+
+    def from_counts(self, C, scale=1):
+        return _native_counts(C, 'nmi')[0]
+
+    def gradient(self, H):
+        """
+        Derivative of NMI with respect to H. Empty histogram entries
+        are assigned zero derivative.
+        """
+        npts = nonzero(self.npoints(H))
+        P = H / npts
+        hI = P.sum(0)
+        hJ = P.sum(1)
+        logP = np.log(nonzero(P))
+        loghI = np.log(nonzero(hI))
+        loghJ = np.log(nonzero(hJ))
+        entIJ = -np.sum(P * logP)
+        entI = -np.sum(hI * loghI)
+        entJ = -np.sum(hJ * loghJ)
+        # Entropy derivatives wrt H, up to a factor -1/npts
+        dentIJ = logP + entIJ
+        dentM = (loghI + entI)[np.newaxis, :] + (loghJ + entJ)[:, np.newaxis]
+        nmi = (entI + entJ) / nonzero(entIJ)
+        g = (nmi * dentIJ - dentM) / (npts * nonzero(entIJ))
+        g[H <= 0] = 0
+        return g
 
 
 class CorrelationCoefficient(SimilarityMeasure):
@@ -187,17 +342,47 @@ class CorrelationCoefficient(SimilarityMeasure):
         return L
 
     def __call__(self, H):
-        npts = nonzero(self.npoints(H))
-        mI = np.sum(H * self.I) / npts
-        mJ = np.sum(H * self.J) / npts
-        vI = np.sum(H * (self.I) ** 2) / npts - mI ** 2
-        vJ = np.sum(H * (self.J) ** 2) / npts - mJ ** 2
-        cIJ = np.sum(H * self.J * self.I) / npts - mI * mJ
+        rho2, npts = _native(H, 'cc')
+        if self.renormalize:
+            rho2 = correlation2loglikelihood(rho2, nonzero(npts),
+                                             self.total_npoints)
+        return rho2
+
+    def from_moments(self, M):
+        n, s1, s2 = M.T
+        i = np.arange(M.shape[0])
+        npts = nonzero(n.sum())
+        mI = s1.sum() / npts
+        mJ = np.dot(n, i) / npts
+        vI = s2.sum() / npts - mI ** 2
+        vJ = np.dot(n, i ** 2) / npts - mJ ** 2
+        cIJ = np.dot(s1, i) / npts - mI * mJ
         rho2 = (cIJ / nonzero(np.sqrt(vI * vJ))) ** 2
         if self.renormalize:
             rho2 = correlation2loglikelihood(rho2, npts, self.total_npoints)
         return rho2
 
+    def gradient(self, H):
+        npts = nonzero(self.npoints(H))
+        mI = np.sum(H * self.I) / npts
+        mJ = np.sum(H * self.J) / npts
+        dI = self.I - mI
+        dJ = self.J - mJ
+        vI = np.sum(H * dI ** 2) / npts
+        vJ = np.sum(H * dJ ** 2) / npts
+        cIJ = np.sum(H * dI * dJ) / npts
+        vIvJ = nonzero(vI * vJ)
+        rho2 = cIJ ** 2 / vIvJ
+        # Derivatives of second order moments wrt H
+        dvI = (dI ** 2 - vI) / npts
+        dvJ = (dJ ** 2 - vJ) / npts
+        dcIJ = (dI * dJ - cIJ) / npts
+        g = (2 * cIJ * dcIJ - rho2 * (dvI * vJ + vI * dvJ)) / vIvJ
+        if self.renormalize:
+            g = correlation2loglikelihood_gradient(rho2, g, npts,
+                                                   self.total_npoints)
+        return g
+
 
 def correlation_ratio(H, Y):
     """Use a nonlinear regression model with Gaussian errors as a
@@ -223,21 +408,104 @@ def correlation_ratio(H, Y):
     return eta2, npts
 
 
+def correlation_ratio_moments(M):
+    """
+    Correlation ratio from the moments of order 0, 1 and 2 of the
+    response variable given each value of the predictor, stored as
+    the columns of `M`. See `correlation_ratio`.
+    """
+    npts_X, s1, s2 = M.T
+    tmp = nonzero(npts_X)
+    mY_X = s1 / tmp
+    vY_X = s2 / tmp - mY_X ** 2
+    npts = np.sum(npts_X)
+    tmp = nonzero(npts)
+    mY = np.sum(s1) / tmp
+    vY = np.sum(s2) / tmp - mY ** 2
+    mean_vY_X = np.sum(npts_X * vY_X) / tmp
+    eta2 = 1. - mean_vY_X / nonzero(vY)
+    return eta2, npts
+
+
+def correlation_ratio_gradient(H, Y):
+    """Derivative of the correlation ratio with respect to H.
+
+    Same conventions as `correlation_ratio`.
+
+    Returns
+    -------
+    eta2: float
+      Correlation ratio
+    npts: float
+      Number of points
+    g: ndarray
+      Derivative of `eta2` with respect to H
+    """
+    npts_X = np.sum(H, 1)
+    tmp = nonzero(npts_X)
+    mY_X = np.sum(H * Y, 1) / tmp
+    npts = nonzero(np.sum(npts_X))
+    hY = np.sum(H, 0)
+    mY = np.sum(hY * Y[0, :]) / npts
+    vY = np.sum(hY * (Y[0, :] - mY) ** 2) / npts
+    # Within-row squared deviations, set to zero in empty rows
+    dY_X = (Y - mY_X[:, np.newaxis]) ** 2
+    dY_X[npts_X <= 0, :] = 0
+    mean_vY_X = np.sum(H * dY_X) / npts
+    eta2 = 1. - mean_vY_X / nonzero(vY)
+    dmean_vY_X = (dY_X - mean_vY_X) / npts
+    dvY = ((Y - mY) ** 2 - vY) / npts
+    g = -(dmean_vY_X - (mean_vY_X / nonzero(vY)) * dvY) / nonzero(vY)
+    return eta2, npts, g
+
+
 class CorrelationRatio(SimilarityMeasure):
     def __call__(self, H):
-        eta2, npts = correlation_ratio(H, self.I)
+        eta2, npts = _native(H, 'cr')
+        if self.renormalize:
+            eta2 = correlation2loglikelihood(eta2, npts, self.total_npoints)
+        return eta2
+
+    def from_hashed(self, T):
+        eta2, npts = _native_hashed(T, 'cr', self.shape)
+        if self.renormalize:
+            eta2 = correlation2loglikelihood(eta2, npts, self.total_npoints)
+        return eta2
+
+    def from_moments(self, M):
+        eta2, npts = correlation_ratio_moments(M)
         if self.renormalize:
             eta2 = correlation2loglikelihood(eta2, npts, self.total_npoints)
         return eta2
 
+    def gradient(self, H):
+        eta2, npts, g = correlation_ratio_gradient(H, self.I)
+        if self.renormalize:
+            g = correlation2loglikelihood_gradient(eta2, g, npts,
+                                                   self.total_npoints)
+        return g
+
 
 class ReverseCorrelationRatio(SimilarityMeasure):
     def __call__(self, H):
-        eta2, npts = correlation_ratio(H.T, self.J.T)
+        eta2, npts = _native(H, 'rcr')
         if self.renormalize:
             eta2 = correlation2loglikelihood(eta2, npts, self.total_npoints)
         return eta2
 
+    def from_hashed(self, T):
+        eta2, npts = _native_hashed(T, 'rcr', self.shape)
+        if self.renormalize:
+            eta2 = correlation2loglikelihood(eta2, npts, self.total_npoints)
+        return eta2
+
+    def gradient(self, H):
+        eta2, npts, g = correlation_ratio_gradient(H.T, self.J.T)
+        if self.renormalize:
+            g = correlation2loglikelihood_gradient(eta2, g, npts,
+                                                   self.total_npoints)
+        return g.T
+
 
 def correlation_ratio_L1(H):
     """
@@ -247,39 +515,96 @@ def correlation_ratio_L1(H):
     Assume the input joint histogram has shape (dimX, dimY) where X is
     the predictor and Y is the response variable.
     """
-    moments = np.array([_L1_moments(H[x, :]) for x in range(H.shape[0])])
-    npts_X, mY_X, sY_X = moments[:, 0], moments[:, 1], moments[:, 2]
+    npts_X, mY_X, sY_X = _L1_moments_rows(H)
     hY = np.sum(H, 0)
-    hX = np.sum(H, 1)
     npts, mY, sY = _L1_moments(hY)
-    mean_sY_X = np.sum(hX * sY_X) / nonzero(npts)
+    mean_sY_X = np.sum(npts_X * sY_X) / nonzero(npts)
     tmp = mean_sY_X / nonzero(sY)
     return 1 - tmp, npts
 
 
+def correlation_ratio_L1_gradient(H):
+    """
+    Derivative of the L1-norm based correlation ratio with respect to
+    H, treating medians as constant (which holds almost everywhere).
+
+    Returns
+    -------
+    eta: float
+      L1 correlation ratio
+    npts: float
+      Number of points
+    g: ndarray
+      Derivative of `eta` with respect to H
+    """
+    npts_X, mY_X, _ = _L1_moments_rows(H)
+    hY = np.sum(H, 0)
+    npts, mY, sY = _L1_moments(hY)
+    npts = nonzero(npts)
+    Y = np.arange(H.shape[1])
+    # Within-row absolute deviations, set to zero in empty rows
+    dY_X = np.abs(Y - mY_X[:, np.newaxis])
+    dY_X[npts_X <= 0, :] = 0
+    mean_sY_X = np.sum(H * dY_X) / npts
+    eta = 1 - mean_sY_X / nonzero(sY)
+    dmean_sY_X = (dY_X - mean_sY_X) / npts
+    dsY = (np.abs(Y - mY) - sY) / npts
+    g = -(dmean_sY_X - (mean_sY_X / nonzero(sY)) * dsY) / nonzero(sY)
+    return eta, npts, g
+
+
+def _L1_renormalization_gradient(eta, g, npts, total_npts):
+    """
+    Derivative of -(npts / total_npts) * log(1 - eta) wrt H given the
+    derivative `g` of `eta`.
+    """
+    return (-np.log(nonzero(1 - eta)) + npts * g / nonzero(1 - eta))\
+        / total_npts
+
+
 class CorrelationRatioL1(CorrelationRatio):
     """
     Use a nonlinear regression model with Laplace distributed errors
     as a distribution model
     """
+    from_moments = None
+    from_hashed = None
+
     def __call__(self, H):
         eta, npts = correlation_ratio_L1(H)
         if self.renormalize:
             eta = -(npts / self.total_npoints) * np.log(nonzero(1 - eta))
         return eta
 
+    def gradient(self, H):
+        eta, npts, g = correlation_ratio_L1_gradient(H)
+        if self.renormalize:
+            g = _L1_renormalization_gradient(eta, g, npts,
+                                             self.total_npoints)
+        return g
+
 
 class ReverseCorrelationRatioL1(CorrelationRatio):
     """
     Use a nonlinear regression model with Laplace distributed errors
     as a distribution model
     """
+    from_moments = None
+    from_hashed = None
+
     def __call__(self, H):
         eta, npts = correlation_ratio_L1(H.T)
         if self.renormalize:
             eta = -(npts / self.total_npoints) * np.log(nonzero(1 - eta))
         return eta
 
+    def gradient(self, H):
+        eta, npts, g = correlation_ratio_L1_gradient(H.T)
+        if self.renormalize:
+            g = _L1_renormalization_gradient(eta, g, npts,
+                                             self.total_npoints)
+        return g.T
+
 
 similarity_measures = {
     'slr': SupervisedLikelihoodRatio,
@@ -1,14 +1,29 @@
 from __future__ import absolute_import
 #!/usr/bin/env python
 
+import os
+import shutil
+import tempfile
+import tracemalloc
+from multiprocessing.pool import ThreadPool
+
 import numpy as np
+import scipy.ndimage as nd
 from nibabel import Nifti1Image
 
 from ..affine import Affine, Rigid
-from ..histogram_registration import HistogramRegistration
-from .._register import _joint_histogram
+from ..chain_transform import ChainTransform
+from ..histogram_registration import (HistogramRegistration, Template,
+                                     register_batch, approx_gradient,
+                                     clamp_array)
+from .._register import (_joint_histogram, _joint_histogram_batch,
+                         _joint_histogram_gradient, _samples, _layout,
+                         _bricked, _occupancy, _fixed_point,
+                         _hashed_histogram, _hashed_dense, _simd,
+                         simd_levels)
 
 from numpy.testing import (assert_array_equal,
+                           assert_array_almost_equal,
                            assert_equal,
                            assert_almost_equal,
                            assert_raises)
@@ -49,6 +64,20 @@ def _test_clamping(I, thI=0.0, clI=256, mask=None):
     return Ic, Ic2
 
 
+def test_clamping_dtype():
+    x = make_data_int16()
+    msk = make_data_bool()
+    y, bins = clamp_array(x, 64, mask=msk)
+    assert_equal(y.dtype, np.uint8)
+    assert_equal(bins, 64)
+    assert_array_equal(y[~msk], 255)
+    assert y[msk].max() < 64
+    y, bins = clamp_array(x, 256, mask=msk)
+    assert_equal(y.dtype, np.short)
+    assert_array_equal(y[~msk], -1)
+    assert_raises(ValueError, clamp_array, x, 2 ** 16)
+
+
 def test_clamping_uint8():
     I = Nifti1Image(make_data_uint8(), dummy_affine)
     _test_clamping(I)
@@ -178,12 +207,882 @@ def test_joint_hist_raw():
     assert_almost_equal(np.diag(np.diag(jh_arr)), jh_arr)
 
 
+def test_joint_hist_affine():
+    # On-the-fly affine transformation should match pre-computed
+    # transformed coordinates
+    data_shape = (10, 12, 8)
+    data = np.random.randint(size=data_shape,
+                             low=-1, high=10).astype(np.short)
+    data2 = -np.ones(np.array(data_shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = data
+    Tv = Affine(np.array((1.2, -.3, .7, .1, -.05, .02,
+                          0, 0, 0, 0, 0, 0))).as_affine()
+    vox_coords = np.indices(data_shape).transpose((1, 2, 3, 0))
+    vox_coords = np.ascontiguousarray(
+        np.dot(vox_coords, Tv[0:3, 0:3].T) + Tv[0:3, 3])
+    jh_arr = np.zeros((10, 10), dtype=np.double)
+    jh_arr2 = np.zeros((10, 10), dtype=np.double)
+    _joint_histogram(jh_arr, data.flat, data2, vox_coords, 0)
+    _joint_histogram(jh_arr2, data.flat, data2,
+                     np.ascontiguousarray(Tv[0:3]), 0)
+    assert_almost_equal(jh_arr, jh_arr2)
+    # Non-contiguous source array
+    jh_arr3 = np.zeros((10, 10), dtype=np.double)
+    _joint_histogram(jh_arr, data[::2, :, ::3].flat, data2,
+                     np.ascontiguousarray(vox_coords[::2, :, ::3]), 0)
+    Tv2 = np.dot(Tv, np.diag((2, 1, 3, 1)))
+    _joint_histogram(jh_arr3, data[::2, :, ::3].flat, data2,
+                     np.ascontiguousarray(Tv2[0:3]), 0)
+    assert_almost_equal(jh_arr, jh_arr3)
+
+
+def test_joint_hist_samples():
+    # Packed samples should only hold unmasked voxels and yield the
+    # same joint histogram as the flat iterator
+    data = np.random.randint(size=(10, 12, 8), low=-1, high=10)
+    data = data.astype(np.short)
+    data2 = -np.ones(np.array(data.shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = data
+    I, XYZ = _samples(data)
+    assert_equal(I.size, (data >= 0).sum())
+    assert_array_equal(data[tuple(XYZ)], I)
+    Tv = np.ascontiguousarray(
+        Affine(np.array((1.2, -.3, .7, .1, -.05, .02,
+                         0, 0, 0, 0, 0, 0))).as_affine()[0:3])
+    jh = np.zeros((10, 10))
+    jh2 = np.zeros((10, 10))
+    _joint_histogram(jh, data.flat, data2, Tv, 0)
+    _joint_histogram(jh2, (I, XYZ), data2, Tv, 0)
+    assert_almost_equal(jh, jh2)
+    # Registration object field of view
+    img = Nifti1Image(make_data_int16(), dummy_affine)
+    R = HistogramRegistration(img, img, spacing=[2, 1, 3])
+    assert_equal(R._from_npoints, (R._from_data >= 0).sum())
+    assert_array_equal(R._from_data[tuple(R._from_coords)], R._from_values)
+
+
+def test_joint_hist_sampling():
+    data = np.random.randint(size=(10, 12, 8), low=-1, high=10)
+    data = data.astype(np.short)
+    data2 = -np.ones(np.array(data.shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = data
+    I, XYZ = _samples(data)
+    Tv = np.ascontiguousarray(np.eye(4)[0:3])
+    jh = np.zeros((10, 10))
+    _joint_histogram(jh, (I, XYZ), data2, Tv, 0)
+    # Stratified sampling with one stratum per sample uses all samples
+    jh1 = np.zeros((10, 10))
+    _joint_histogram(jh1, (I, XYZ), data2, Tv, 0, sampling=2,
+                     nsamples=I.size, seed=3)
+    assert_array_equal(jh1, jh)
+    # Stochastic subsets are reproducible given the seed
+    for sampling in (1, 2):
+        jh1 = np.zeros((10, 10))
+        jh2 = np.zeros((10, 10))
+        _joint_histogram(jh1, (I, XYZ), data2, Tv, 0, sampling=sampling,
+                         nsamples=100, seed=3)
+        _joint_histogram(jh2, (I, XYZ), data2, Tv, 0, sampling=sampling,
+                         nsamples=100, seed=3, nthreads=1)
+        assert_array_equal(jh1, jh2)
+        assert_almost_equal(jh1.sum(), 100)
+        # Draws do not depend on the splitting across threads
+        _joint_histogram(jh2, (I, XYZ), data2, Tv, 0, sampling=sampling,
+                         nsamples=100, seed=3, nthreads=3)
+        assert_array_almost_equal(jh2, jh1)
+
+
+def test_sampling_registration():
+    I = Nifti1Image(make_data_int16(), dummy_affine)
+    R = HistogramRegistration(I, I, similarity='cc', spacing=[1, 1, 1],
+                              sampling='stratified', nsamples=5000)
+    assert_equal(R.sampling, 'stratified')
+    assert_almost_equal(R.eval(Affine()), 1)
+    T = Affine(np.random.normal(scale=.1, size=12))
+    for optimizer in ('powell', 'bfgs'):
+        R.optimize(T.copy(), optimizer=optimizer, maxiter=2)
+        assert R._sampling_seed is None
+    R.sampling = None
+    assert_equal(R.sampling, None)
+
+
+def test_joint_hist_threads():
+    data = np.random.randint(size=(20, 15, 10), low=-1, high=10)
+    data = data.astype(np.short)
+    data2 = -np.ones(np.array(data.shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = data
+    Tv = np.ascontiguousarray(
+        Affine(np.array((1.2, -.3, .7, .1, -.05, .02,
+                         0, 0, 0, 0, 0, 0))).as_affine()[0:3])
+    for interp in (0, 1, -3):
+        jh = np.zeros((10, 10))
+        _joint_histogram(jh, data.flat, data2, Tv, interp)
+        for nthreads in (2, 3, 7):
+            jh1 = np.zeros((10, 10))
+            jh2 = np.zeros((10, 10))
+            _joint_histogram(jh1, data.flat, data2, Tv, interp, nthreads)
+            _joint_histogram(jh2, data.flat, data2, Tv, interp, nthreads)
+            assert_array_equal(jh1, jh2)
+            assert_almost_equal(jh1, jh)
+
+
+def test_joint_hist_batch():
+    data = np.random.randint(size=(20, 15, 10), low=-1, high=10)
+    data = data.astype(np.short)
+    data2 = -np.ones(np.array(data.shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = data
+    Tvs = np.array([Affine(np.random.normal(scale=.1, size=12)).as_affine()[0:3]
+                    for k in range(5)])
+    for interp in (0, 1, -3):
+        for nthreads in (1, 3):
+            jhs = np.zeros((5, 10, 10))
+            _joint_histogram_batch(jhs, data.flat, data2, Tvs, interp, nthreads)
+            for k in range(5):
+                jh = np.zeros((10, 10))
+                _joint_histogram(jh, data.flat, data2,
+                                 np.ascontiguousarray(Tvs[k]), interp)
+                assert_almost_equal(jhs[k], jh)
+
+
+
+def test_joint_hist_simd():
+    # Every instruction set supported by the build and the CPU should
+    # match the scalar version up to rounding, including for samples
+    # transformed outside the target grid
+    data = np.random.randint(size=(21, 15, 11), low=-1, high=10)
+    data = data.astype(np.short)
+    data2 = -np.ones(np.array(data.shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = data
+    src = _samples(data)
+    Tvs = np.array([Affine(np.random.normal(scale=.2, size=12)).as_affine()[0:3]
+                    for k in range(3)])
+    Tvs[:, :, 3] += 2
+    default = _simd()
+    levels = [l for l in simd_levels if _simd(l) == l]
+    try:
+        for interp in (0, 1, 2, -3):
+            jhs = {}
+            for level in levels:
+                _simd(level)
+                jh = np.zeros((4, 10, 10))
+                _joint_histogram(jh[0], src, data2, Tvs[0], interp)
+                _joint_histogram_batch(jh[1:], src, data2, Tvs, interp)
+                jhs[level] = jh
+            for level in levels:
+                assert_array_almost_equal(jhs[level], jhs['scalar'],
+                                          decimal=10)
+                assert_array_equal(jhs[level][0], jhs[level][1])
+    finally:
+        _simd(default)
+    assert_equal(_simd(), default)
+
+def test_joint_hist_moments():
+    data = np.random.randint(size=(20, 15, 10), low=-1, high=10)
+    data = data.astype(np.short)
+    data2 = -np.ones(np.array(data.shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = data
+    Tv = Affine(np.random.normal(scale=.1, size=12)).as_affine()[0:3]
+    j = np.arange(10)
+    for interp in (0, 1):
+        jh = np.zeros((10, 10))
+        _joint_histogram(jh, data.flat, data2, Tv, interp)
+        M = np.zeros((10, 3))
+        _joint_histogram(M, data.flat, data2, Tv, interp, moments=1)
+        assert_array_almost_equal(M, np.array([jh.sum(1), np.dot(jh, j),
+                                               np.dot(jh, j ** 2)]).T)
+        Ms = np.zeros((2, 10, 3))
+        _joint_histogram_batch(Ms, data.flat, data2, np.array([Tv, Tv]),
+                               interp, moments=1)
+        assert_array_almost_equal(Ms[1], M)
+
+
+def test_moments_registration():
+    I = Nifti1Image(make_data_int16(), dummy_affine)
+    J = Nifti1Image(make_data_int16(), dummy_affine)
+    T = Affine(np.random.normal(scale=.1, size=12))
+    for similarity in ('cc', 'cr'):
+        for interp in ('pv', 'tri'):
+            R = HistogramRegistration(I, J, similarity=similarity,
+                                      interp=interp)
+            s = R.eval(T)
+            assert R._hist is None
+            assert_almost_equal(R.eval_batch(T, [T.param])[0], s)
+            # Same as the value computed from the joint histogram
+            R._similarity_call.from_moments = None
+            assert_almost_equal(R.eval(T), s)
+
+
+def test_joint_hist_bricked():
+    data = np.random.randint(size=(20, 15, 10), low=-1, high=10)
+    data = data.astype(np.short)
+    data2 = -np.ones(np.array(data.shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = data
+    src = _samples(data)
+    Tv = Affine(np.random.normal(scale=.1, size=12)).as_affine()[0:3]
+    Tv[:, 3] += np.random.normal(size=3)
+    for brick in (1, 4, 8):
+        bdata2 = _bricked(data2, brick)
+        layout = _layout(bdata2.shape, brick)
+        assert_equal(bdata2.shape, -(-np.array(data2.shape) // brick) * brick)
+        for interp in (0, 1, -3):
+            jh = np.zeros((10, 10))
+            jh1 = np.zeros((10, 10))
+            _joint_histogram(jh, src, data2, Tv, interp)
+            _joint_histogram(jh1, src, bdata2, Tv, interp, layout=layout)
+            assert_array_almost_equal(jh1, jh)
+            jhs = np.zeros((1, 10, 10))
+            _joint_histogram_batch(jhs, src, bdata2, Tv[np.newaxis], interp,
+                                   layout=layout)
+            assert_array_almost_equal(jhs[0], jh)
+        g = np.zeros((10, 10, 12))
+        g1 = np.zeros((10, 10, 12))
+        _joint_histogram_gradient(jh, g, src, data2, Tv)
+        _joint_histogram_gradient(jh1, g1, src, bdata2, Tv, layout=layout)
+        assert_array_almost_equal(jh1, jh)
+        assert_array_almost_equal(g1, g)
+
+
+def test_samples_tiled():
+    data = np.random.randint(size=(20, 15, 10), low=-1, high=10)
+    data = data.astype(np.short)
+    I, XYZ = _samples(data)
+    for tile in (1, 4, 8):
+        tI, tXYZ = _samples(data, tile)
+        assert_equal(tI.size, I.size)
+        # Same voxels, visited tile by tile
+        assert_array_equal(data[tuple(tXYZ)], tI)
+        assert_array_equal(np.sort(np.ravel_multi_index(tXYZ, data.shape)),
+                           np.ravel_multi_index(XYZ, data.shape))
+        keys = np.concatenate((tXYZ // tile, tXYZ))
+        assert_array_equal(np.lexsort(keys[::-1]), np.arange(tI.size))
+    data2 = -np.ones(np.array(data.shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = data
+    Tv = Affine(np.random.normal(scale=.1, size=12)).as_affine()[0:3]
+    for interp in (0, 1):
+        jh = np.zeros((10, 10))
+        jh1 = np.zeros((10, 10))
+        _joint_histogram(jh, (I, XYZ), data2, Tv, interp)
+        _joint_histogram(jh1, _samples(data, 8), data2, Tv, interp)
+        assert_array_almost_equal(jh1, jh)
+
+
+def test_tiled_registration():
+    I = Nifti1Image(make_data_int16(), dummy_affine)
+    J = Nifti1Image(make_data_int16(), dummy_affine)
+    T = Affine(np.random.normal(scale=.1, size=12))
+    R = HistogramRegistration(I, J)
+    R1 = HistogramRegistration(I, J, tile=8)
+    assert_almost_equal(R1.eval(T), R.eval(T))
+    R.set_fov(npoints=1000)
+    R1.set_fov(npoints=1000, tile=4)
+    assert_almost_equal(R1.eval(T), R.eval(T))
+
+
+def test_joint_hist_uint8():
+    data = np.random.randint(size=(20, 15, 10), low=-1, high=10)
+    data2 = -np.ones(np.array(data.shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = np.random.randint(size=data.shape,
+                                                low=-1, high=10)
+    Tv = Affine(np.random.normal(scale=.1, size=12)).as_affine()[0:3]
+    Tv[:, 3] += np.random.normal(size=3)
+    src = _samples(data.astype(np.short))
+    # Masked voxels (-1) are cast to 255 in unsigned char arrays
+    usrc = _samples(data.astype(np.uint8))
+    assert_equal(usrc[0].dtype, np.uint8)
+    assert_array_equal(usrc[0], src[0])
+    assert_array_equal(usrc[1], src[1])
+    udata2 = data2.astype(np.uint8)
+    for s, t in ((src, udata2), (usrc, data2), (usrc, udata2)):
+        for interp in (0, 1, -3):
+            jh = np.zeros((10, 10))
+            jh1 = np.zeros((10, 10))
+            _joint_histogram(jh, src, data2, Tv, interp)
+            _joint_histogram(jh1, s, t, Tv, interp)
+            assert_array_equal(jh1, jh)
+            jhs = np.zeros((1, 10, 10))
+            _joint_histogram_batch(jhs, s, t, Tv[np.newaxis], interp)
+            assert_array_almost_equal(jhs[0], jh)
+        g = np.zeros((10, 10, 12))
+        g1 = np.zeros((10, 10, 12))
+        _joint_histogram_gradient(jh, g, src, data2, Tv)
+        _joint_histogram_gradient(jh1, g1, s, t, Tv)
+        assert_array_equal(jh1, jh)
+        assert_array_equal(g1, g)
+    # Bricked unsigned char target image
+    bdata2 = _bricked(udata2, 8)
+    assert_array_equal(bdata2[data2.shape[0]:], 255)
+    jh = np.zeros((10, 10))
+    jh1 = np.zeros((10, 10))
+    _joint_histogram(jh, src, data2, Tv, 0)
+    _joint_histogram(jh1, usrc, bdata2, Tv, 0,
+                     layout=_layout(bdata2.shape, 8))
+    assert_array_almost_equal(jh1, jh)
+    assert_raises(RuntimeError, _joint_histogram, jh, src,
+                  data2.astype(np.intc), Tv, 0)
+
+
+def test_uint8_registration():
+    I = Nifti1Image(make_data_int16(), dummy_affine)
+    J = Nifti1Image(make_data_int16(), dummy_affine)
+    R = HistogramRegistration(I, J, bins=64)
+    assert_equal(R._from_data.dtype, np.uint8)
+    assert_equal(R._to_data.dtype, np.uint8)
+    assert_equal(R._to_data[0, 0, 0], 255)
+    # Same registration with signed short encoded images
+    R1 = HistogramRegistration(I, J, bins=64)
+    to_data = R1._to_data.astype(np.short)
+    to_data[R1._to_data == 255] = -1
+    R1._to_data = to_data
+    R1._from_values = R1._from_values.astype(np.short)
+    T = Affine(np.random.normal(scale=.1, size=12))
+    assert_almost_equal(R.eval(T), R1.eval(T))
+    R2 = HistogramRegistration(I, J, bins=(64, 256))
+    assert_equal(R2._from_data.dtype, np.uint8)
+    assert_equal(R2._to_data.dtype, np.short)
+
+
+def test_joint_hist_fixed_point():
+    data = np.random.randint(size=(30, 25, 20), low=-1, high=10)
+    data = data.astype(np.short)
+    data2 = -np.ones(np.array(data.shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = data
+    src = _samples(data)
+    Tv = Affine(np.random.normal(scale=.1, size=12)).as_affine()[0:3]
+    Tv[:, 3] += np.random.normal(size=3)
+    Tf = _fixed_point(Tv)
+    assert_equal(Tf.dtype, np.intc)
+    assert_array_equal(Tf, np.round(Tv * 65536))
+    out = np.zeros((3, 4), dtype=np.intc)
+    assert _fixed_point(Tv, out=out) is out
+    assert_array_equal(out, Tf)
+    assert_array_equal(_fixed_point([[1e6, -1e6, .5 / 65536]]),
+                       [[2 ** 31 - 1, -2 ** 31, 0]])
+    coords = np.dot(src[1].T, Tv[:, 0:3].T) + Tv[:, 3]
+    for interp in (0, 1):
+        jh = np.zeros((10, 10))
+        jh1 = np.zeros((10, 10))
+        _joint_histogram(jh, src, data2, Tv, interp)
+        _joint_histogram(jh1, src, data2, Tf, interp)
+        # Bounded deviation from double precision
+        assert np.abs(jh1 - jh).sum() < .05 * jh.sum()
+        # Incremental coordinates do not depend on the traversal order
+        jh2 = np.zeros((10, 10))
+        _joint_histogram(jh2, _samples(data, 4), data2, Tf, interp)
+        assert_array_almost_equal(jh2, jh1)
+        jhs = np.zeros((1, 10, 10))
+        _joint_histogram_batch(jhs, src, data2, Tf[np.newaxis], interp)
+        assert_array_almost_equal(jhs[0], jh1)
+        # Pre-computed fixed-point coordinates
+        _joint_histogram(jh2, src, data2, _fixed_point(coords), interp)
+        assert np.abs(jh2 - jh).sum() < .05 * jh.sum()
+    g = np.zeros((10, 10, 12))
+    assert_raises(RuntimeError, _joint_histogram_gradient, jh, g, src,
+                  data2, Tf)
+
+
+def test_fixed_point_registration():
+    I = Nifti1Image(make_data_int16(), dummy_affine)
+    J = Nifti1Image(make_data_int16(), dummy_affine)
+    T = Affine(np.random.normal(scale=.1, size=12))
+    R = HistogramRegistration(I, J, similarity='cc')
+    R1 = HistogramRegistration(I, J, similarity='cc', fixed_point=True)
+    assert_almost_equal(R1.eval(T), R.eval(T), decimal=2)
+    params = [T.param, np.zeros(12)]
+    assert_array_almost_equal(R1.eval_batch(T, params),
+                              [R1.eval(T), R1.eval(Affine())])
+
+
+def test_joint_hist_row_clipping():
+    # Partial coverage of the target grid, including rotations where
+    # rows are parallel to the grid boundary
+    data = np.random.randint(size=(20, 15, 30), low=-1, high=10)
+    data = data.astype(np.short)
+    data2 = -np.ones((12, 17, 14), dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = np.random.randint(size=(10, 15, 12),
+                                                low=0, high=10)
+    for angles in ((0, 0, 0), (0, 0, .4), (.3, -.2, .5), (0, .1, -.6)):
+        A = Affine(np.concatenate(((-4, 1, -9), angles,
+                                   (0, 0, 0, 0, 0, 0)))).as_affine()[0:3]
+        for tile in (0, 4):
+            src = _samples(data, tile)
+            for Tv in (A, _fixed_point(A)):
+                for interp in (0, 1, -3):
+                    jh = np.zeros((10, 10))
+                    jhs = np.zeros((1, 10, 10))
+                    _joint_histogram(jh, src, data2, Tv, interp, nthreads=3)
+                    # The batch routine does not clip rows
+                    _joint_histogram_batch(jhs, src, data2, Tv[np.newaxis],
+                                           interp)
+                    assert_array_almost_equal(jh, jhs[0])
+                    assert jh.sum() > 0
+
+
+def test_bricked_registration():
+    I = Nifti1Image(make_data_int16(), dummy_affine)
+    J = Nifti1Image(make_data_int16(), dummy_affine)
+    T = Affine(np.random.normal(scale=.1, size=12))
+    R = HistogramRegistration(I, J)
+    R1 = HistogramRegistration(I, J, brick=8)
+    assert_almost_equal(R1.eval(T), R.eval(T))
+
+
+def test_joint_hist_occupancy():
+    # Target with large masked regions, which the occupancy map allows
+    # to skip without changing the histograms
+    data = np.random.randint(size=(20, 15, 30), low=-1, high=10)
+    data = data.astype(np.short)
+    data2 = -np.ones((32, 27, 34), dtype=np.short)
+    data2[8:15, 1:-1, 16:29] = np.random.randint(size=(7, 25, 13),
+                                                 low=-1, high=10)
+    occ = _occupancy(data2)
+    assert_equal(occ.shape, (4, 4, 5))
+    assert occ.sum() < occ.size
+    src = _samples(data)
+    A = Affine(np.concatenate(((2, 1, 3), (.1, -.2, .3),
+                               (0, 0, 0, 0, 0, 0)))).as_affine()[0:3]
+    coords = np.dot(src[1].T, A[:, 0:3].T) + A[:, 3]
+    for Tv in (A, _fixed_point(A), coords):
+        for interp in (0, 1, -3):
+            jh = np.zeros((10, 10))
+            jh1 = np.zeros((10, 10))
+            _joint_histogram(jh, src, data2, Tv, interp)
+            _joint_histogram(jh1, src, data2, Tv, interp, nthreads=3,
+                             occupancy=occ)
+            assert_array_almost_equal(jh1, jh)
+            assert jh.sum() > 0
+            if Tv is coords:
+                continue
+            jhs = np.zeros((1, 10, 10))
+            _joint_histogram_batch(jhs, src, data2, Tv[np.newaxis], interp,
+                                   occupancy=occ)
+            assert_array_almost_equal(jhs[0], jh)
+    g = np.zeros((10, 10, 12))
+    g1 = np.zeros((10, 10, 12))
+    _joint_histogram_gradient(jh, g, src, data2, A)
+    _joint_histogram_gradient(jh1, g1, src, data2, A, occupancy=occ)
+    assert_array_almost_equal(jh1, jh)
+    assert_array_almost_equal(g1, g)
+    # Bricked target, padded with masked voxels
+    bdata2 = _bricked(data2, 8)
+    _joint_histogram(jh1, src, bdata2, A, 0,
+                     layout=_layout(bdata2.shape, 8),
+                     occupancy=_occupancy(data2, bdata2.shape))
+    _joint_histogram(jh, src, data2, A, 0)
+    assert_array_almost_equal(jh1, jh)
+    # Occupancy maps of the wrong shape are rejected
+    assert_raises(RuntimeError, _joint_histogram, jh, src, data2, A, 0,
+                  occupancy=occ[1:])
+
+
+def test_masked_occupancy_registration():
+    I = Nifti1Image(make_data_int16(), dummy_affine)
+    J = Nifti1Image(make_data_int16(), dummy_affine)
+    mask = np.zeros(J.shape, dtype=bool)
+    mask[20:60, 30:80, 10:40] = True
+    T = Affine(np.random.normal(scale=.1, size=12))
+    R = HistogramRegistration(I, J, to_mask=mask)
+    assert R._to_occupancy is not None
+    val = R.eval(T)
+    R._to_occupancy = None
+    assert_almost_equal(R.eval(T), val)
+
+
+def test_joint_hist_hashed():
+    data = np.random.randint(size=(30, 25, 20), low=-1, high=300)
+    data = data.astype(np.short)
+    data2 = -np.ones(np.array(data.shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = np.random.randint(size=data.shape, low=-1,
+                                                high=500)
+    src = _samples(data)
+    A = Affine(np.random.normal(scale=.1, size=12)).as_affine()[0:3]
+    coords = np.dot(src[1].T, A[:, 0:3].T) + A[:, 3]
+    for Tv in (A, _fixed_point(A), coords):
+        for interp in (0, 1, -3):
+            jh = np.zeros((300, 500))
+            _joint_histogram(jh, src, data2, Tv, interp)
+            for nthreads in (1, 3):
+                # Tables too small at first grow as needed
+                T = _joint_histogram(_hashed_histogram(16), src, data2, Tv,
+                                     interp, nthreads=nthreads, hashed=1)
+                assert_equal(T[-1], [np.sum(jh > 0), 0])
+                assert T.shape[0] - 1 >= 2 * T[-1, 0]
+                assert_array_almost_equal(_hashed_dense(T, jh.shape), jh)
+    # Stochastic sampling
+    jh = np.zeros((300, 500))
+    _joint_histogram(jh, src, data2, A, 0, sampling=2, nsamples=1000,
+                     seed=3)
+    T = _joint_histogram(_hashed_histogram(16), src, data2, A, 0,
+                         sampling=2, nsamples=1000, seed=3, hashed=1)
+    assert_array_almost_equal(_hashed_dense(T, jh.shape), jh)
+    # Capacities should be powers of two
+    assert_raises(RuntimeError, _joint_histogram, np.zeros((6, 2)), src,
+                  data2, A, 0, hashed=1)
+
+
+def test_hashed_registration():
+    I = Nifti1Image(make_data_int16(), dummy_affine)
+    J = Nifti1Image(make_data_int16(), dummy_affine)
+    T = Affine(np.random.normal(scale=.1, size=12))
+    for similarity in ('mi', 'nmi', 'rcr'):
+        for interp in ('pv', 'tri', 'rand'):
+            R = HistogramRegistration(I, J, bins=1024, similarity=similarity,
+                                      interp=interp)
+            R1 = HistogramRegistration(I, J, bins=1024,
+                                       similarity=similarity,
+                                       interp=interp, hashed=True)
+            assert R1._from_hashed()
+            # Same random interpolation seed
+            np.random.seed(0)
+            s = R.eval(T)
+            np.random.seed(0)
+            assert_almost_equal(R1.eval(T), s)
+            assert R1._hist is None
+            if interp == 'rand':
+                continue
+            params = [T.param, np.zeros(12)]
+            assert_array_almost_equal(R1.eval_batch(T, params),
+                                      R.eval_batch(T, params))
+    # Measures computed from moments or dense histograms only
+    for similarity in ('cc', 'crl1', 'pmi'):
+        R = HistogramRegistration(I, J, similarity=similarity, hashed=True)
+        assert not R._from_hashed()
+
+
+def test_joint_hist_counts():
+    data = np.random.randint(size=(30, 25, 20), low=-1, high=300)
+    data = data.astype(np.short)
+    data2 = -np.ones(np.array(data.shape) + 2, dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = np.random.randint(size=data.shape, low=-1,
+                                                high=500)
+    src = _samples(data)
+    A = Affine(np.random.normal(scale=.1, size=12)).as_affine()[0:3]
+    coords = np.dot(src[1].T, A[:, 0:3].T) + A[:, 3]
+    for Tv in (A, _fixed_point(A), coords):
+        jh = np.zeros((300, 500))
+        _joint_histogram(jh, src, data2, Tv, -3)
+        # Threads share the count histogram, which is reset first
+        C = np.ones((300, 500), dtype='uint32')
+        for nthreads in (1, 3):
+            _joint_histogram(C, src, data2, Tv, -3, nthreads=nthreads)
+            assert_array_equal(C, jh)
+    jh = np.zeros((300, 500))
+    _joint_histogram(jh, src, data2, A, -3, sampling=1, nsamples=1000,
+                     seed=3)
+    _joint_histogram(C, src, data2, A, -3, sampling=1, nsamples=1000, seed=3)
+    assert_array_equal(C, jh)
+    # Only random interpolation yields integer counts
+    for interp in (0, 1, 2):
+        assert_raises(RuntimeError, _joint_histogram, C, src, data2, A,
+                      interp)
+
+
+def test_counts_registration():
+    I = Nifti1Image(make_data_int16(), dummy_affine)
+    J = Nifti1Image(make_data_int16(), dummy_affine)
+    T = Affine(np.random.normal(scale=.1, size=12))
+    for similarity in ('mi', 'nmi'):
+        for renormalize in (False, True):
+            R = HistogramRegistration(I, J, bins=64, similarity=similarity,
+                                      interp='rand', renormalize=renormalize,
+                                      sampling='random', nsamples=5000)
+            assert R._from_counts()
+            R._sampling_seed = 1
+            np.random.seed(0)
+            s = R.eval(T)
+            assert R._hist is None
+            R._from_counts = lambda: False
+            np.random.seed(0)
+            assert_almost_equal(R.eval(T), s)
+    for interp in ('pv', 'tri'):
+        R = HistogramRegistration(I, J, similarity='mi', interp=interp)
+        assert not R._from_counts()
+    R = HistogramRegistration(I, J, similarity='cr', interp='rand')
+    assert not R._from_counts()
+
+
+def test_counts_batch():
+    # Batches share the random numbers of a single evaluation, and
+    # use the same count histogram kernel
+    I = Nifti1Image(make_data_int16(dx=30, dy=30, dz=20), dummy_affine)
+    J = Nifti1Image(make_data_int16(dx=30, dy=30, dz=20), dummy_affine)
+    T = Affine()
+    params = np.random.normal(scale=.1, size=(3, 12))
+    for fixed_point in (False, True):
+        R = HistogramRegistration(I, J, bins=64, similarity='mi',
+                                  interp='rand', fixed_point=fixed_point,
+                                  sampling='random', nsamples=2000)
+        R._sampling_seed = 1
+        np.random.seed(0)
+        s = R.eval_batch(T, params)
+        assert R._counts_hist is not None
+        for k in range(params.shape[0]):
+            T.param = params[k]
+            np.random.seed(0)
+            assert_equal(R.eval(T), s[k])
+
+
+def test_joint_hist_parzen():
+    # Target intensities away from the histogram edges, so that
+    # Parzen windows are not folded
+    data = np.random.randint(size=(20, 15, 10), low=-1, high=10)
+    data = data.astype(np.short)
+    data2 = -np.ones((22, 17, 12), dtype=np.short)
+    data2[1:-1, 1:-1, 1:-1] = np.random.randint(size=(20, 15, 10), low=1,
+                                                high=8)
+    data2[data2 == 1] = -1
+    src = _samples(data)
+    A = Affine(np.random.normal(scale=.1, size=12)).as_affine()[0:3]
+    coords = np.dot(src[1].T, A[:, 0:3].T) + A[:, 3]
+    j = np.arange(10)
+    for Tv in (A, _fixed_point(A), coords):
+        jh = np.zeros((10, 10))
+        jht = np.zeros((10, 10))
+        m = np.zeros((10, 3))
+        _joint_histogram(jh, src, data2, Tv, 2)
+        _joint_histogram(jht, src, data2, Tv, 1)
+        _joint_histogram(m, src, data2, Tv, 2, moments=1)
+        # Same mass as trilinear interpolation, spread over more bins
+        assert_array_almost_equal(jh.sum(1), jht.sum(1))
+        assert np.sum(jh > 0) > np.sum(jht > 0)
+        assert_array_almost_equal(m, np.array([jh.sum(1), np.dot(jh, j),
+                                               np.dot(jh, j ** 2)]).T)
+    jhs = np.zeros((1, 10, 10))
+    _joint_histogram_batch(jhs, src, data2, A[np.newaxis], 2)
+    _joint_histogram(jh, src, data2, A, 2)
+    assert_array_almost_equal(jhs[0], jh)
+    assert_raises(RuntimeError, _joint_histogram, _hashed_histogram(16),
+                  src, data2, A, 2, hashed=1)
+    # Unknown positive interpolation codes are rejected
+    for interp in (3, 4):
+        assert_raises(RuntimeError, _joint_histogram, jh, src, data2, A,
+                      interp)
+        assert_raises(RuntimeError, _joint_histogram_batch, jhs, src,
+                      data2, A[np.newaxis], interp)
+    # Gradient against finite differences, up to the few samples
+    # crossing voxel boundaries where the gradient is discontinuous
+    g = np.zeros((10, 10, 12))
+    jh1 = np.zeros((10, 10))
+    _joint_histogram_gradient(jh1, g, src, data2, A, interp=2)
+    assert_array_almost_equal(jh1, jh)
+    eps = 1e-6
+    for k in range(12):
+        jhp = np.zeros((10, 10))
+        jhm = np.zeros((10, 10))
+        dA = np.zeros(12)
+        dA[k] = eps
+        _joint_histogram(jhp, src, data2, A + dA.reshape((3, 4)), 2)
+        _joint_histogram(jhm, src, data2, A - dA.reshape((3, 4)), 2)
+        err = (jhp - jhm) / (2 * eps) - g[..., k]
+        assert np.abs(err).sum() < 1e-2 * np.abs(g[..., k]).sum()
+    assert_raises(RuntimeError, _joint_histogram_gradient, jh1, g, src,
+                  data2, A, interp=1)
+
+
+def test_parzen_registration():
+    I = Nifti1Image(make_data_int16(dx=30, dy=30, dz=20), dummy_affine)
+    J = Nifti1Image(make_data_int16(dx=30, dy=30, dz=20), dummy_affine)
+    T = Affine(np.random.normal(scale=.05, size=12))
+    R = HistogramRegistration(I, J, similarity='mi', bins=16,
+                              interp='parzen', hashed=True)
+    assert not R._from_hashed()
+    Tv = ChainTransform(T.copy(), pre=R._from_affine, post=R._to_inv_affine)
+    assert R._has_gradient(Tv)
+    s, g = R._eval_gradient(Tv)
+    assert_almost_equal(s, R.eval(T))
+
+    def simi(param):
+        T2 = T.copy()
+        T2.param = param
+        return R.eval(T2)
+
+    g2 = approx_gradient(simi, T.param, 1e-4)
+    assert np.abs(g - g2).max() < 1e-2 * np.abs(g).max()
+
+
+def test_pyramid_levels():
+    I = Nifti1Image(make_data_int16(dx=30, dy=30, dz=20), dummy_affine)
+    R = HistogramRegistration(I, I, bins=32, spacing=[1, 1, 1])
+    pyramid = R._default_pyramid(3, 1e-2, 1e-2)
+    assert_equal([p['spacing'] for p in pyramid], [[4, 4, 4], [2, 2, 2]])
+    assert_equal([p['sigma'] for p in pyramid], [(2, 2), (1, 1)])
+    R1 = R._pyramid_level(spacing=pyramid[0]['spacing'],
+                          sigma=pyramid[0]['sigma'])
+    assert_equal(R1._from_spacing, (4, 4, 4))
+    assert_equal(R1._bins, R._bins)
+    assert R._pyramid_level(spacing=4, sigma=2) is R1
+    R.interp = 'tri'
+    assert_equal(R._pyramid_level(bins=16)._bins, (16, 16))
+    assert_equal(R._pyramid_level(bins=16).interp, 'tri')
+    assert_equal(len(R._levels), 2)
+
+
+def test_pyramid_registration():
+    data = nd.gaussian_filter(np.random.rand(40, 40, 30), 2)
+    data = (1000 * (data - data.min()) / (data.max() - data.min()))
+    I = Nifti1Image(data[4:-4, 4:-4, 4:-4].astype('int16'), dummy_affine)
+    J = Nifti1Image(data[7:-1, 2:-6, 4:-4].astype('int16'), dummy_affine)
+    R = HistogramRegistration(I, J, bins=32, similarity='cc',
+                              spacing=[1, 1, 1])
+    for pyramid in (3, [{'spacing': 2, 'sigma': 1, 'maxiter': 10}]):
+        T = R.optimize('rigid', pyramid=pyramid)
+        assert np.abs(T.translation - [-3, 2, 0]).max() < .5
+    # The second pyramid reuses the finer level of the first one
+    assert_equal(len(R._levels), 2)
+
+
+def test_eval_workspace():
+    I = Nifti1Image(make_data_int16(dx=60, dy=60, dz=40), dummy_affine)
+    T = Affine(np.random.normal(scale=.05, size=12))
+    nbytes = 8 * 256 ** 2
+    for similarity in ('mi', 'cc'):
+        R = HistogramRegistration(I, I, bins=256, similarity=similarity,
+                                  nthreads=2, fixed_point=True)
+        s = R.eval(T)
+        params = [T.param, np.zeros(12)]
+        simis = R.eval_batch(T, params)
+        # Steady-state evaluations reuse the workspace rather than
+        # allocating histogram-sized arrays
+        tracemalloc.start()
+        try:
+            assert_almost_equal(R.eval(T), s)
+            assert_array_almost_equal(R.eval_batch(T, params), simis)
+            peak = tracemalloc.get_traced_memory()[1]
+        finally:
+            tracemalloc.stop()
+        assert peak < nbytes / 4
+        R2 = HistogramRegistration(I, I, bins=256, similarity=similarity,
+                                   fixed_point=True)
+        assert_almost_equal(R2.eval(T), s)
+
+
+def test_cached_registration():
+    I = Nifti1Image(make_data_int16(dx=30, dy=30, dz=20), dummy_affine)
+    J = Nifti1Image(make_data_int16(dx=30, dy=30, dz=20), dummy_affine)
+    mask = np.zeros(J.shape, dtype='bool')
+    mask[5:20, 5:25, 3:17] = True
+    T = Affine(np.random.normal(scale=.05, size=12))
+    cache = tempfile.mkdtemp()
+    try:
+        for args in ({}, {'to_mask': mask, 'brick': 8, 'sigma': 1}):
+            R = HistogramRegistration(I, J, bins=64, **args)
+            R1 = HistogramRegistration(I, J, bins=64, cache=cache, **args)
+            R2 = HistogramRegistration(I, J, bins=64, cache=cache, **args)
+            # Cached arrays are memory-mapped
+            assert isinstance(R2._to_data, np.memmap)
+            assert isinstance(R2._from_img.get_data(), np.memmap)
+            for Rk in (R1, R2):
+                assert_equal(Rk._bins, R._bins)
+                assert_array_equal(Rk._from_data, R._from_data)
+                assert_array_equal(Rk._to_data, R._to_data)
+                if R._to_occupancy is not None:
+                    assert_array_equal(Rk._to_occupancy, R._to_occupancy)
+                assert_almost_equal(Rk.eval(T), R.eval(T))
+        # One entry per argument set and image, of 3 files for the
+        # `from` image and 4 files for the `to` image
+        assert_equal(len(os.listdir(cache)), 2 * 7)
+        # Other preprocessing parameters or contents get other entries
+        HistogramRegistration(I, J, bins=32, cache=cache)
+        J2 = Nifti1Image(J.get_data() + 1, dummy_affine)
+        HistogramRegistration(I, J2, bins=64, cache=cache)
+        assert_equal(len(os.listdir(cache)), 3 * 7 + 4)
+        # Workers concurrently filling a new cache directory
+        subdir = os.path.join(cache, 'sub')
+        Rs = ThreadPool(4).map(
+            lambda k: HistogramRegistration(I, J, bins=64, cache=subdir),
+            range(8))
+        for Rk in Rs:
+            assert_array_equal(Rk._to_data, Rs[0]._to_data)
+        assert_equal(len(os.listdir(subdir)), 7)
+    finally:
+        shutil.rmtree(cache)
+
+
+def test_template():
+    I = Nifti1Image(make_data_int16(dx=30, dy=30, dz=20), dummy_affine)
+    J = Nifti1Image(make_data_int16(dx=30, dy=30, dz=20), dummy_affine)
+    mask = np.zeros(J.shape, dtype='bool')
+    mask[5:20, 5:25, 3:17] = True
+    T = Affine(np.random.normal(scale=.05, size=12))
+    template = Template(J, 64, mask=mask, sigma=1, brick=8)
+    R = HistogramRegistration(I, J, bins=64, sigma=(0, 1), to_mask=mask,
+                              brick=8)
+    for R1 in (HistogramRegistration(I, template, bins=64),
+               HistogramRegistration(I, template, bins=(64, 32),
+                                     sigma=(0, 3))):
+        assert R1._to_data is template.data
+        assert R1._to_occupancy is template.occupancy
+        assert_equal(R1._bins, R._bins)
+        assert_almost_equal(R1.eval(T), R.eval(T))
+        # Pyramid levels are built from the template image
+        R2 = R1._pyramid_level(spacing=2)
+        assert_equal(R2._to_sigma, 1)
+        assert R2._to_occupancy is not None
+
+
+def test_register_batch():
+    data = nd.gaussian_filter(np.random.rand(40, 40, 30), 2)
+    data = (1000 * (data - data.min()) / (data.max() - data.min()))
+    J = Nifti1Image(data[4:-4, 4:-4, 4:-4].astype('int16'), dummy_affine)
+    shifts = ((0, 0), (3, 0), (0, -2))
+    imgs = [Nifti1Image(data[4 + x:36 + x, 4 + y:36 + y, 4:-4]
+                        .astype('int16'), dummy_affine) for x, y in shifts]
+    Ts = {}
+    for nworkers in (1, 2):
+        Ts[nworkers], times = register_batch(
+            imgs, J, T='rigid', nworkers=nworkers, bins=32,
+            similarity='cc', spacing=[1, 1, 1])
+        assert_equal(times.shape, (3, 2))
+        assert np.all(times >= 0)
+        for T, (x, y) in zip(Ts[nworkers], shifts):
+            assert isinstance(T, Rigid)
+            assert np.abs(T.translation - [x, y, 0]).max() < .5
+    for T1, T2 in zip(Ts[1], Ts[2]):
+        assert_array_almost_equal(T1.param, T2.param)
+
+
 def test_explore():
     I = Nifti1Image(make_data_int16(), dummy_affine)
     J = Nifti1Image(make_data_int16(), dummy_affine)
     R = HistogramRegistration(I, J)
     T = Affine()
     simi, params = R.explore(T, (0, [-1, 0, 1]), (1, [-1, 0, 1]))
+    for s, p in zip(simi, params.T):
+        T.param = p
+        assert_almost_equal(s, R.eval(T))
+
+
+def test_explore_workers():
+    I = Nifti1Image(make_data_int16(), dummy_affine)
+    J = Nifti1Image(make_data_int16(), dummy_affine)
+    for similarity in ('cc', 'crl1'):
+        R = HistogramRegistration(I, J, similarity=similarity, nthreads=2)
+        T = Affine()
+        grid = ((0, [-1, 0, 1]), (1, [-1, 0, 1]), (5, [-.1, .1]))
+        s, p = R.explore(T, *grid)
+        for nworkers in (2, 5):
+            s2, p2 = R.explore(T, *grid, nworkers=nworkers)
+            assert_array_almost_equal(s2, s)
+            assert_array_equal(p2, p)
+    # Workers share images but not histograms or buffers
+    W = R._worker()
+    assert W._to_data is R._to_data
+    assert W._workspace is not R._workspace
+    assert_equal(W.nthreads, 1)
+    assert_raises(TypeError, R.explore, T, (0, [0]), workers=2)
+
+
+def test_search():
+    data = nd.gaussian_filter(np.random.rand(40, 40, 30), 2)
+    data = (1000 * (data - data.min()) / (data.max() - data.min()))
+    I = Nifti1Image(data[4:-4, 4:-4, 4:-4].astype('int16'), dummy_affine)
+    J = Nifti1Image(data[8:, 4:-4, 4:-4].astype('int16'), dummy_affine)
+    R = HistogramRegistration(I, J, bins=32, similarity='cc',
+                              spacing=[1, 1, 1])
+    T0 = Rigid()
+    for nworkers in (1, 2):
+        T = R.search(T0, (0, [-8, -4, 0, 4]), nstarts=2, nworkers=nworkers)
+        assert np.abs(T.translation - [-4, 0, 0]).max() < .5
+    # The initial transformation is left unchanged
+    assert_array_equal(T0.param, 0)
 
 
 def test_histogram_registration():
@@ -248,6 +1147,37 @@ def test_similarity_derivatives():
     assert_equal(H, np.zeros((6, 6)))
 
 
+def test_analytic_gradient():
+    """ Test analytic gradient computation against finite differences.
+    """
+    np.random.seed(0)
+    I = Nifti1Image(make_data_int16(dx=30, dy=30, dz=20), dummy_affine)
+    J = Nifti1Image(make_data_int16(dx=30, dy=30, dz=20), dummy_affine)
+    T = Affine(np.random.normal(scale=.05, size=12))
+    for simi in ('cc', 'cr', 'crl1', 'mi', 'nmi', 'rcr'):
+        R = HistogramRegistration(I, J, similarity=simi, bins=16,
+                                  sigma=1.5)
+        Tv = ChainTransform(T.copy(), pre=R._from_affine,
+                            post=R._to_inv_affine)
+        assert R._has_gradient(Tv)
+        s, g = R._eval_gradient(Tv)
+        assert_almost_equal(s, R.eval(T))
+        R.interp = 'tri'
+        assert not R._has_gradient(Tv)
+        R.interp = 'pv'
+
+        def simi(param):
+            T2 = T.copy()
+            T2.param = param
+            return R.eval(T2)
+
+        # Central differences, with an absolute floor for measures
+        # with small gradients
+        g2 = approx_gradient(simi, T.param, 1e-4)
+        assert np.abs(g - g2).max() < 1e-2 * np.abs(g).max() + 1e-4
+        assert_array_almost_equal(R.eval_gradient(T), g)
+
+
 def test_smoothing():
     """ Test smoothing the `to` image.
     """
@@ -0,0 +1,126 @@
+from __future__ import absolute_import
+
+import numpy as np
+
+from ..similarity_measures import (similarity_measures, SimilarityMeasure,
+                                   correlation_ratio,
+                                   correlation2loglikelihood, nonzero)
+
+from .._register import (_L1_moments, _L1_moments_rows, _hashed_histogram,
+                         _hashed_merge)
+
+from numpy.testing import (assert_almost_equal, assert_array_almost_equal,
+                           assert_equal)
+
+
+def make_histogram(shape=(20, 30)):
+    H = np.random.rand(*shape)
+    H[H < .3] = 0
+    H[3, :] = 0
+    return 100 * H
+
+
+def ref_nmi(H):
+    P = H / nonzero(H.sum())
+    hI = P.sum(0)
+    hJ = P.sum(1)
+    entIJ = -np.sum(P * np.log(nonzero(P)))
+    entI = -np.sum(hI * np.log(nonzero(hI)))
+    entJ = -np.sum(hJ * np.log(nonzero(hJ)))
+    return (entI + entJ) / nonzero(entIJ)
+
+
+def ref_cc(H):
+    J, I = np.indices(H.shape)
+    npts = nonzero(H.sum())
+    mI = np.sum(H * I) / npts
+    mJ = np.sum(H * J) / npts
+    vI = np.sum(H * I ** 2) / npts - mI ** 2
+    vJ = np.sum(H * J ** 2) / npts - mJ ** 2
+    cIJ = np.sum(H * J * I) / npts - mI * mJ
+    return (cIJ / nonzero(np.sqrt(vI * vJ))) ** 2
+
+
+def test_native_measures():
+    H = make_histogram()
+    J, I = np.indices(H.shape)
+    total = 2 * H.sum()
+    dist = make_histogram() + 1
+    for renormalize in (False, True):
+        for name, ref in (('mi', SimilarityMeasure.__call__),
+                          ('slr', SimilarityMeasure.__call__),
+                          ('nmi', lambda m, H: ref_nmi(H)),
+                          ('cc', lambda m, H: ref_cc(H)),
+                          ('cr', lambda m, H: correlation_ratio(H, I)[0]),
+                          ('rcr',
+                           lambda m, H: correlation_ratio(H.T, J.T)[0])):
+            m = similarity_measures[name](H.shape, total,
+                                          renormalize=renormalize,
+                                          dist=dist)
+            expected = ref(m, H)
+            if renormalize and name in ('cc', 'cr', 'rcr'):
+                expected = correlation2loglikelihood(expected, H.sum(), total)
+            assert_almost_equal(m(H), expected)
+            # Non-contiguous and non-double input
+            assert_almost_equal(m(np.asfortranarray(H)), expected)
+            assert_almost_equal(m(H.astype('float32')), expected, decimal=4)
+
+
+def test_native_measures_empty():
+    H = np.zeros((10, 10))
+    for name in ('mi', 'nmi', 'cc'):
+        m = similarity_measures[name](H.shape, 1)
+        assert_almost_equal(m(H), 0)
+
+
+def make_hashed(H):
+    # Hashed histogram of H, built by merging a table holding one
+    # entry per non-empty cell
+    i, j = np.nonzero(H)
+    P = np.zeros((2 ** int(np.ceil(np.log2(i.size + 1))) + 1, 2))
+    P[:i.size, 0] = i * 32768 + j + 1
+    P[:i.size, 1] = H[i, j]
+    T = _hashed_histogram(i.size)
+    _hashed_merge(T, P)
+    return T
+
+
+def test_hashed_measures():
+    H = make_histogram()
+    T = make_hashed(H)
+    assert_equal(T[-1], [np.sum(H > 0), 0])
+    total = 2 * H.sum()
+    for renormalize in (False, True):
+        for name in ('mi', 'nmi', 'cr', 'rcr'):
+            m = similarity_measures[name](H.shape, total,
+                                          renormalize=renormalize)
+            assert_almost_equal(m.from_hashed(T), m(H))
+    for name in ('cc', 'pmi', 'dpmi', 'crl1', 'rcrl1', 'slr'):
+        assert getattr(similarity_measures[name], 'from_hashed',
+                       None) is None
+
+
+def test_counts_measures():
+    H = np.round(make_histogram())
+    H[0, 0] = 10000
+    C = H.astype('uint32')
+    total = 2 * H.sum()
+    for renormalize in (False, True):
+        for name in ('mi', 'nmi'):
+            m = similarity_measures[name](H.shape, total,
+                                          renormalize=renormalize)
+            assert_almost_equal(m.from_counts(C), m(H))
+            assert_almost_equal(m.from_counts(C, 2.5), m(2.5 * H))
+    for name in ('cc', 'cr', 'rcr', 'pmi', 'dpmi', 'crl1', 'rcrl1', 'slr'):
+        assert getattr(similarity_measures[name], 'from_counts',
+                       None) is None
+
+
+def test_L1_moments_rows():
+    H = make_histogram()
+    for h in (H, H.T):
+        expected = np.array([_L1_moments(h[x, :]) for x in range(h.shape[0])])
+        n, median, dev = _L1_moments_rows(h)
+        assert_array_almost_equal(n, expected[:, 0])
+        assert_array_almost_equal(median, expected[:, 1])
+        assert_array_almost_equal(dev, expected[:, 2])
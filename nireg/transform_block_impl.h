@@ -0,0 +1,102 @@
+/* 
+   Affine transformation of blocks of source samples for a given
+   instruction set, see the _transform_block functions in
+   joint_histogram.c. This file is included by joint_histogram.c once
+   for each instruction set, with the following macros defined:
+
+   TRANSFORM_BLOCK : name of the function
+
+   TARGET_ATTRIBUTE : function attribute enabling the instruction
+   set, or empty if it is enabled at compile time
+
+   LANES : number of doubles per vector, along with the VECTOR,
+   VECTORI and MASK types and the vector operations used below. If
+   undefined, a scalar loop is compiled.
+*/ 
+
+#ifdef LANES
+/* Transformed coordinate along axis a, floor neighbor and weight */ 
+#define VECTOR_AXIS(a, n, w, m, dim)					\
+  T = ADD(ADD(ADD(MUL(SET1(t[4*a]), vx), MUL(SET1(t[4*a+1]), vy)),	\
+	      MUL(SET1(t[4*a+2]), vz)), SET1(t[4*a+3]));		\
+  m = AND(GT(T, SET1(-1)), LT(T, SET1(dim)));				\
+  vn = CVTT(ADD(T, SET1(1)));						\
+  STOREI(n+k, vn);							\
+  STORE(w+k, SUB(CVTI(vn), T))
+#endif
+
+static TARGET_ATTRIBUTE unsigned int TRANSFORM_BLOCK(int* nx, 
+						     int* ny, 
+						     int* nz, 
+						     double* wx, 
+						     double* wy, 
+						     double* wz, 
+						     const int* x, 
+						     const int* y, 
+						     const int* z, 
+						     const double* t, 
+						     const double* dims)
+{
+  unsigned int inside = 0; 
+  int k; 
+#ifdef LANES
+  VECTOR vx, vy, vz, T; 
+  VECTORI vn; 
+  MASK mx, my, mz; 
+
+  for (k=0; k<SAMPLE_BLOCK; k+=LANES) {
+    vx = LOADI(x+k); 
+    vy = LOADI(y+k); 
+    vz = LOADI(z+k); 
+    VECTOR_AXIS(0, nx, wx, mx, dims[0]); 
+    VECTOR_AXIS(1, ny, wy, my, dims[1]); 
+    VECTOR_AXIS(2, nz, wz, mz, dims[2]); 
+    inside |= MOVEMASK(AND(AND(mx, my), mz)) << k; 
+  }
+#else
+  double Tx, Ty, Tz; 
+
+  for (k=0; k<SAMPLE_BLOCK; k++) {
+    Tx = t[0]*x[k] + t[1]*y[k] + t[2]*z[k] + t[3]; 
+    Ty = t[4]*x[k] + t[5]*y[k] + t[6]*z[k] + t[7]; 
+    Tz = t[8]*x[k] + t[9]*y[k] + t[10]*z[k] + t[11]; 
+    if ((Tx>-1) && (Tx<dims[0]) && 
+	(Ty>-1) && (Ty<dims[1]) && 
+	(Tz>-1) && (Tz<dims[2])) {
+      inside |= 1u << k; 
+      nx[k] = (int)(Tx+1); 
+      ny[k] = (int)(Ty+1); 
+      nz[k] = (int)(Tz+1); 
+      wx[k] = nx[k] - Tx; 
+      wy[k] = ny[k] - Ty; 
+      wz[k] = nz[k] - Tz; 
+    }
+  }
+#endif
+
+  return inside; 
+}
+
+
+#ifdef LANES
+#undef LANES
+#undef VECTOR
+#undef VECTORI
+#undef MASK
+#undef LOADI
+#undef SET1
+#undef ADD
+#undef SUB
+#undef MUL
+#undef AND
+#undef GT
+#undef LT
+#undef CVTT
+#undef CVTI
+#undef STORE
+#undef STOREI
+#undef MOVEMASK
+#undef VECTOR_AXIS
+#endif
+#undef TRANSFORM_BLOCK
+#undef TARGET_ATTRIBUTE